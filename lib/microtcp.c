@@ -18,233 +18,2782 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE  /*sendmmsg and recvmmsg*/
 #include "microtcp.h"
+#include "microtcp_cc.h"
+#include "microtcp_uring.h"
+#include "microtcp_timer.h"
 #include "../utils/crc32.h"
 #include <stdio.h>
 #include <errno.h>
+#include <limits.h>
 #include <time.h>
+#include <netinet/udp.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <linux/errqueue.h>
+#include <pthread.h>
+#include <sched.h>
+
+/*a full data segment, the size the kernel cuts a GSO buffer at*/
+#define GSO_SIZE (sizeof(microtcp_header_t) + MICROTCP_MSS)
+/*full segments in one GSO buffer, it has to fit in a single UDP datagram*/
+#define GSO_MAX_SEGS (65507 / GSO_SIZE)
+/*the same with MSG_ZEROCOPY: every header and every page of payload is a fragment of the buffer, which has 17
+ *(MAX_SKB_FRAGS) at most*/
+#define GSO_MAX_SEGS_ZC 5
+
+/*a GRO buffer can hold up to 64 KB of coalesced segments*/
+#define GRO_SLOT_LEN 65536
+#define RX_ARENA_LEN (4 * GRO_SLOT_LEN)
+#define RX_MAX_SEGS 256
+/*segments a connection of a listener can have waiting in its queue, a batch of the listener at most*/
+#define RX_QUEUE_SLOTS MICROTCP_BATCH
+/*the segments of the pool of a connection are allocated this many at a time, as its window grows*/
+#define TXQ_CHUNK_SEGS 32
+
+/*buckets of the connection table of a listener, a power of two*/
+#define DEMUX_BUCKETS 4096
+
+/*how long each step of the close handshake waits for the peer*/
+#define CLOSE_TIMEOUT_US 1000000
+
+/*the datagrams of one recvmmsg and the segments they split into*/
+struct microtcp_rxbatch
+{
+  uint8_t *arena;               /*RX_ARENA_LEN bytes, or the queue of RX_QUEUE_SLOTS segments of a connection of a listener*/
+  size_t arena_len;
+  struct mmsghdr msgs[MICROTCP_BATCH];
+  struct iovec iovs[MICROTCP_BATCH];
+  char ctrl[MICROTCP_BATCH][CMSG_SPACE(sizeof(int))];
+  struct sockaddr_storage names[MICROTCP_BATCH];  /*the sources of the datagrams, kept only by a listener*/
+  int slots;
+  int gro;
+
+  /*with io_uring every slot has a receive posted, the slots of the last batch are posted again by the next call*/
+  struct microtcp_uring *ring;
+  uint32_t taken[MICROTCP_BATCH];
+  int ntaken;
+  int left_first;               /*segments of the last batch that recv_segment() has not taken yet*/
+  int left;
+  struct {
+    message_t *mssg;
+    size_t len;
+    int msg;                    /*the datagram the segment came in*/
+  } segs[RX_MAX_SEGS];
+
+  /*on a connection of a listener the arena is a queue of the segments the listener handed over to it*/
+  size_t q_head;
+  size_t q_count;
+  size_t q_taken;               /*segments the last recv_batch() returned, released by the next call*/
+  uint16_t q_len[RX_QUEUE_SLOTS];
+};
+
+/*links a connection in a bucket of the table of its listener*/
+struct microtcp_demux_node
+{
+  microtcp_sock_t *conn;
+  struct microtcp_demux_node *next;
+};
+
+/*the timers of a connection*/
+enum
+{
+  TIMER_RTO,                    /*retransmits the oldest segment in flight*/
+  TIMER_PERSIST,                /*probes the window the receiver closed while nothing is in flight*/
+  TIMER_DELACK,                 /*sends the ACK that waited for a second segment*/
+  TIMER_PACE,                   /*wakes the loop when the pacing lets the next segment leave*/
+  TIMER_CLOSE,                  /*bounds each step of the close handshake*/
+  TIMER_KINDS
+};
+
+/*segments of the pool of a connection, allocated together*/
+struct microtcp_txchunk
+{
+  struct microtcp_txchunk *next;
+  microtcp_txseg_t segs[TXQ_CHUNK_SEGS];
+};
+
+/*the buffers of a connection, allocated when it is established and recycled for as long as it lives. the
+ *segments grow in chunks up to what the window needs*/
+struct microtcp_pool
+{
+  struct microtcp_rxbatch rx;
+  microtcp_timer_t timer[TIMER_KINDS];
+  microtcp_wheel_t *timers;                 /*the wheel the timers are in, the one of the loop that serves the socket*/
+  microtcp_wheel_t wheel;                   /*the wheel of the socket while no loop serves it*/
+  message_t ctl;                            /*the handshake, the ACKs and the rest of the control segments*/
+  microtcp_txseg_t *free_segs;              /*the segments that are not in the retransmission queue*/
+  struct microtcp_txchunk *chunks;          /*every segment of the pool*/
+  int nsegs;                                /*the segments in the chunks, MICROTCP_TXQ_SEGS at most*/
+  struct sockaddr_storage peer;             /*the address of the peer, the socket keeps its own copy*/
+  struct microtcp_demux_node node;
+  int zerocopy;                             /*MSG_ZEROCOPY is 1 on, -1 off, 0 not tried yet*/
+  uint32_t zc_sent;                         /*datagrams sent with MSG_ZEROCOPY*/
+  uint32_t zc_done;                         /*the ones of them whose pages the kernel released*/
+  size_t zc_queued;                         /*bytes of the buffers of microtcp_send_zc() in the retransmission queue*/
+};
+
+/*a SYN waiting in the backlog of a listener for microtcp_accept_conn()*/
+struct microtcp_syn
+{
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  microtcp_header_t header;
+};
+
+/*a UDP socket shared by many connections. whoever reads from it hands every segment to the queue of the
+ *connection its source address belongs to*/
+struct microtcp_listener
+{
+  int sd;
+  int gro;
+  uint64_t rcvtimeo_us;         /*the SO_RCVTIMEO currently set on sd, 0 for none*/
+  struct microtcp_rxbatch rx;
+  struct microtcp_demux_node *buckets[DEMUX_BUCKETS];
+  size_t conns;
+  struct microtcp_syn *backlog; /*a circular queue*/
+  int backlog_max;
+  int backlog_head;
+  int backlog_count;
+};
+
+/*a burst of segments that leaves with one sendmmsg, with GSO the runs of full segments leave as one buffer*/
+typedef struct
+{
+  struct iovec iovs[2 * MICROTCP_BATCH];  /*the header of each segment, then its payload if it is not behind it*/
+  int seg_iov[MICROTCP_BATCH + 1];        /*the first iovec of each segment, the last one ends the iovecs*/
+  size_t lens[MICROTCP_BATCH];            /*the length of each segment*/
+  int first_seg[MICROTCP_BATCH];          /*the first segment of each datagram*/
+  struct mmsghdr msgs[MICROTCP_BATCH];
+  char ctrl[MICROTCP_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+  int count;
+  int zerocopy;                           /*a payload is in the buffer of the application*/
+} tx_batch_t;
+
+/*how far a send got in the iovecs of the application*/
+typedef struct
+{
+  const struct iovec *iov;
+  int iovcnt;
+  size_t off;                             /*bytes of iov[0] that are already queued*/
+} iov_cursor_t;
+
+/*a socket of a microtcp_loop_t*/
+struct microtcp_loop_entry
+{
+  microtcp_sock_t *socket;
+  uint32_t events;
+  void *data;
+  int fd;                       /*the descriptor in the epoll set, -1 for the connections of a listener*/
+};
+
+struct microtcp_loop
+{
+  int epfd;
+  int tfd;                      /*a timerfd set to the earliest timer of the sockets*/
+  uint64_t timer_us;            /*when tfd expires, 0 if it is disarmed*/
+  microtcp_wheel_t wheel;       /*the timers of every connection in the set*/
+  struct microtcp_loop_entry **entries;
+  int count;
+  int size;
+  int next;                     /*where the next microtcp_poll() starts to report, so no socket starves*/
+};
+
+/*holds the workers of microtcp_serve() until every thread exists, so none runs if the server cannot start*/
+struct microtcp_gate
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int state;                    /*0 while the threads start, 1 to run, -1 to return at once*/
+};
+
+/*a worker of microtcp_serve(), the listener and everything its connections hold belong to its thread alone*/
+struct microtcp_worker
+{
+  pthread_t thread;
+  struct microtcp_gate *gate;
+  microtcp_sock_t listener;
+  int id;
+  int cpu;                      /*the CPU the thread is pinned to, -1 for none*/
+  microtcp_worker_fn fn;
+  void *arg;
+};
+
+/*monotonic clock in microseconds*/
+static uint64_t
+now_us (void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*sets how long a receive call on sd blocks, 0 for ever. the system call is made only when the value changes*/
+static void
+sd_set_timeout (int sd, uint64_t *cached, uint64_t usec)
+{
+  struct timeval timeout;
+
+  if (usec == *cached) return;
+
+  timeout.tv_sec = usec / 1000000;
+  timeout.tv_usec = usec % 1000000;
+  if (setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(struct timeval)) < 0) {
+    perror("setsockopt");
+    return;
+  }
+  *cached = usec;
+}
+
+/*sets the timeout of the receive calls of the socket, the connections of a listener share the one of the listener*/
+static void
+set_recv_timeout (microtcp_sock_t *socket, uint64_t usec)
+{
+  if (usec == 0) usec = 1;  /*0 would block forever*/
+  sd_set_timeout(socket->sd, socket->listener != NULL ? &socket->listener->rcvtimeo_us : &socket->rcvtimeo_us, usec);
+}
+
+/*updates the smoothed RTT and the RTO with a new RTT sample (RFC 6298)*/
+static void
+rtt_sample (microtcp_sock_t *socket, uint64_t rtt)
+{
+  uint64_t delta;
+
+  socket->latest_rtt_us = rtt;
+
+  if (socket->srtt_us == 0) {
+    socket->srtt_us = rtt ? rtt : 1;
+    socket->rttvar_us = rtt / 2;
+  } else {
+    delta = socket->srtt_us > rtt ? socket->srtt_us - rtt : rtt - socket->srtt_us;
+    socket->rttvar_us = (3 * socket->rttvar_us + delta) / 4;
+    socket->srtt_us = (7 * socket->srtt_us + rtt) / 8;
+  }
+
+  socket->rto_us = socket->srtt_us + 4 * socket->rttvar_us;
+  if (socket->rto_us < MICROTCP_MIN_RTO_US) socket->rto_us = MICROTCP_MIN_RTO_US;
+  if (socket->rto_us > MICROTCP_MAX_RTO_US) socket->rto_us = MICROTCP_MAX_RTO_US;
+}
+
+/*the timer expired, double the RTO until a new RTT sample arrives*/
+static void
+rto_backoff (microtcp_sock_t *socket)
+{
+  socket->rto_us = MIN(2 * socket->rto_us, MICROTCP_MAX_RTO_US);
+}
+
+/*computes the CRC-32 of the header (with a zeroed checksum field) and the payload of the segment*/
+static uint32_t
+segment_checksum (message_t *mssg)
+{
+  uint32_t saved = mssg->header.checksum;
+  uint32_t checksum;
+
+  mssg->header.checksum = 0;
+  checksum = crc32((const uint8_t *)mssg, MICROTCP_SEGMENT_LEN(mssg));
+  mssg->header.checksum = saved;
+
+  return checksum;
+}
+
+/*puts the header and data_len bytes of payload of an already checksummed segment on the wire*/
+static ssize_t
+xmit_segment (microtcp_sock_t *socket, const message_t *mssg, int flags)
+{
+  return sendto(socket->sd, mssg, MICROTCP_SEGMENT_LEN(mssg), flags, socket->destaddr, socket->destaddr_len);
+}
+
+/*fills the checksum and sends the segment*/
+static ssize_t
+send_segment (microtcp_sock_t *socket, message_t *mssg, int flags)
+{
+  mssg->header.checksum = segment_checksum(mssg);
+  return xmit_segment(socket, mssg, flags);
+}
+
+/*checks that a datagram of bytes_received bytes is a whole segment, its lengths add up*/
+static int
+segment_sane (message_t *mssg, ssize_t bytes_received)
+{
+  return bytes_received >= (ssize_t)sizeof(microtcp_header_t)
+         && MICROTCP_OPT_LEN(&mssg->header) + mssg->header.data_len <= MICROTCP_MSS
+         && (size_t)bytes_received == MICROTCP_SEGMENT_LEN(mssg);
+}
+
+/*checks that a datagram of bytes_received bytes is a whole segment with the right checksum*/
+static int
+segment_valid (message_t *mssg, ssize_t bytes_received)
+{
+  return segment_sane(mssg, bytes_received) && mssg->header.checksum == segment_checksum(mssg);
+}
+
+/*splits the arena in one slot per datagram, a few large ones for GRO buffers or one per segment without GRO.
+ *a listener keeps the source of every datagram too*/
+static void
+rxbatch_layout (struct microtcp_rxbatch *rx, int gro, int named)
+{
+  size_t slot_len = gro ? GRO_SLOT_LEN : sizeof(message_t);
+
+  rx->slots = gro ? RX_ARENA_LEN / GRO_SLOT_LEN : MICROTCP_BATCH;
+  rx->gro = gro;
+  memset(rx->msgs, 0, sizeof(rx->msgs));
+  for (int i = 0; i < rx->slots; i++) {
+    rx->iovs[i].iov_base = rx->arena + i * slot_len;
+    rx->iovs[i].iov_len = slot_len;
+    rx->msgs[i].msg_hdr.msg_iov = &rx->iovs[i];
+    rx->msgs[i].msg_hdr.msg_iovlen = 1;
+    rx->msgs[i].msg_hdr.msg_control = rx->ctrl[i];
+    if (named) rx->msgs[i].msg_hdr.msg_name = &rx->names[i];
+  }
+}
+
+/*the window we advertise, the free space of the receive buffer after the in-order data, in units of our scale*/
+static uint16_t
+rcv_window (microtcp_sock_t *socket)
+{
+  return MIN((socket->recvbuf_len - socket->buf_fill_level) >> socket->rcv_wscale, UINT16_MAX);
+}
+
+/*the smallest scale that lets the window cover the largest receive buffer the socket may have*/
+static uint8_t
+wscale_pick (microtcp_sock_t *socket)
+{
+  size_t max_len = socket->recvbuf_autotune ? MICROTCP_RECVBUF_MAX : socket->recvbuf_len;
+  uint8_t shift = 0;
+
+  while (shift < MICROTCP_MAX_WSCALE && (max_len >> shift) > UINT16_MAX) shift++;
+
+  return shift;
+}
+
+/*allocates the receive buffer with the size the socket asked for*/
+static int
+recvbuf_init (microtcp_sock_t *socket)
+{
+  free(socket->recvbuf);
+  socket->recvbuf = malloc(socket->recvbuf_len);
+  if (socket->recvbuf == NULL) return -1;
+
+  socket->recvbuf_head = 0;
+  socket->buf_fill_level = 0;
+  socket->rcv_copied = 0;
+  socket->rcv_epoch_us = now_us();
+  socket->rcv_acked = socket->ack_number;
+  socket->rcv_quickack = MICROTCP_QUICKACKS;
+
+  return 0;
+}
+
+/*copies data in the ring at pos bytes after the head*/
+static void
+ring_write (microtcp_sock_t *socket, size_t pos, const uint8_t *src, size_t len)
+{
+  size_t idx = (socket->recvbuf_head + pos) & (socket->recvbuf_len - 1);
+  size_t first = MIN(len, socket->recvbuf_len - idx);
+
+  memcpy(socket->recvbuf + idx, src, first);
+  memcpy(socket->recvbuf, src + first, len - first);
+}
+
+/*same as ring_write(), updating the CRC-32 over the data in the same pass*/
+static uint32_t
+ring_write_crc (microtcp_sock_t *socket, size_t pos, const uint8_t *src, size_t len, uint32_t crc)
+{
+  size_t idx = (socket->recvbuf_head + pos) & (socket->recvbuf_len - 1);
+  size_t first = MIN(len, socket->recvbuf_len - idx);
+
+  crc = update_crc32_copy(crc, socket->recvbuf + idx, src, first);
+  return update_crc32_copy(crc, socket->recvbuf, src + first, len - first);
+}
+
+/*copies len bytes from the head of the ring*/
+static void
+ring_read (microtcp_sock_t *socket, uint8_t *dst, size_t len)
+{
+  size_t first = MIN(len, socket->recvbuf_len - socket->recvbuf_head);
+
+  memcpy(dst, socket->recvbuf + socket->recvbuf_head, first);
+  memcpy(dst + first, socket->recvbuf, len - first);
+}
+
+/*adds the segments of the datagram in slot i to the batch, a GRO buffer is split back into the segments the
+ *kernel coalesced. returns the new number of segments*/
+static int
+rxbatch_split (struct microtcp_rxbatch *rx, int i, int nsegs)
+{
+  struct cmsghdr *cmsg;
+  uint8_t *data = rx->iovs[i].iov_base;
+  size_t left = rx->msgs[i].msg_len;
+  size_t seg_len = left;
+  int gso_size;
+
+  for (cmsg = CMSG_FIRSTHDR(&rx->msgs[i].msg_hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&rx->msgs[i].msg_hdr, cmsg)) {
+    if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+      memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+      /*a segment size that breaks the alignment of the headers leaves the buffer whole, it fails the validation*/
+      if (gso_size > 0 && gso_size % sizeof(uint32_t) == 0) seg_len = gso_size;
+    }
+  }
+
+  while (left > 0 && nsegs < RX_MAX_SEGS) {
+    rx->segs[nsegs].mssg = (message_t *)data;
+    rx->segs[nsegs].len = MIN(seg_len, left);
+    rx->segs[nsegs].msg = i;
+    data += rx->segs[nsegs].len;
+    left -= rx->segs[nsegs].len;
+    nsegs++;
+  }
+
+  return nsegs;
+}
+
+/*posts the receive of slot i on the ring*/
+static int
+rxbatch_post (struct microtcp_rxbatch *rx, uint32_t i)
+{
+  rx->msgs[i].msg_hdr.msg_controllen = sizeof(rx->ctrl[i]);
+  rx->msgs[i].msg_hdr.msg_namelen = sizeof(rx->names[i]);
+  return microtcp_uring_post_recv(rx->ring, &rx->msgs[i].msg_hdr, i);
+}
+
+/*moves the receive path of rx to io_uring, with a receive posted in every slot. returns -1 if the kernel cannot*/
+static int
+rxbatch_ring_start (struct microtcp_rxbatch *rx, int sd)
+{
+  rx->ring = microtcp_uring_create(sd, rx->slots);
+  if (rx->ring == NULL) return -1;
+
+  rx->ntaken = 0;
+  rx->left = 0;
+  for (int i = 0; i < rx->slots; i++) {
+    if (rxbatch_post(rx, i) == -1) {
+      microtcp_uring_free(rx->ring);
+      rx->ring = NULL;
+      return -1;
+    }
+  }
+
+  return microtcp_uring_submit(rx->ring);
+}
+
+static void
+rxbatch_ring_stop (struct microtcp_rxbatch *rx)
+{
+  microtcp_uring_free(rx->ring);
+  rx->ring = NULL;
+}
+
+/*the rxbatch_recv() of io_uring: the datagrams are already in the slots whose receives completed*/
+static int
+rxbatch_recv_ring (struct microtcp_rxbatch *rx, int flags, uint64_t timeout_us)
+{
+  uint32_t slots[MICROTCP_BATCH];
+  int32_t res[MICROTCP_BATCH];
+  int completed, nsegs = 0;
+
+  /*what recv_segment() left of the last batch comes first*/
+  if (rx->left > 0) {
+    memmove(&rx->segs[0], &rx->segs[rx->left_first], rx->left * sizeof(rx->segs[0]));
+    nsegs = rx->left;
+    rx->left = 0;
+    return nsegs;
+  }
+
+  /*the segments of the last batch are processed by now*/
+  for (int i = 0; i < rx->ntaken; i++) {
+    if (rxbatch_post(rx, rx->taken[i]) == -1) return -1;
+  }
+  rx->ntaken = 0;
+
+  completed = microtcp_uring_recv(rx->ring, slots, res, rx->slots, timeout_us, flags & MSG_DONTWAIT);
+  if (completed == -1) return -1;
+
+  for (int i = 0; i < completed; i++) {
+    rx->taken[rx->ntaken++] = slots[i];
+    /*a failed receive is only posted again*/
+    if (res[i] <= 0) continue;
+    rx->msgs[slots[i]].msg_len = res[i];
+    nsegs = rxbatch_split(rx, slots[i], nsegs);
+  }
+
+  /*only failed receives completed*/
+  if (nsegs == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  return nsegs;
+}
+
+/*waits for a datagram on sd and takes along every other datagram that is already queued, up to the slots of rx.
+ *timeout_us is the SO_RCVTIMEO of sd, the ring needs it to wait as long.
+ *returns the number of segments received or -1 with errno set (EAGAIN on timeout)*/
+static int
+rxbatch_recv (int sd, struct microtcp_rxbatch *rx, int flags, uint64_t timeout_us)
+{
+  int received, nsegs = 0;
+
+  if (rx->ring != NULL) return rxbatch_recv_ring(rx, flags, timeout_us);
+
+  for (int i = 0; i < rx->slots; i++) {
+    rx->msgs[i].msg_hdr.msg_controllen = sizeof(rx->ctrl[i]);
+    rx->msgs[i].msg_hdr.msg_namelen = sizeof(rx->names[i]);
+  }
+
+  received = recvmmsg(sd, rx->msgs, rx->slots, flags | MSG_WAITFORONE, NULL);
+  if (received == -1) return -1;
+
+  for (int i = 0; i < received; i++) nsegs = rxbatch_split(rx, i, nsegs);
+
+  return nsegs;
+}
+
+/*hash of the address and the port of a peer*/
+static size_t
+addr_hash (const struct sockaddr *addr)
+{
+  const uint8_t *bytes;
+  size_t len;
+  uint16_t port;
+  uint32_t hash = 2166136261u;  /*FNV-1a*/
+
+  if (addr->sa_family == AF_INET6) {
+    bytes = (const uint8_t *)&((const struct sockaddr_in6 *)addr)->sin6_addr;
+    len = sizeof(struct in6_addr);
+    port = ((const struct sockaddr_in6 *)addr)->sin6_port;
+  } else {
+    bytes = (const uint8_t *)&((const struct sockaddr_in *)addr)->sin_addr;
+    len = sizeof(struct in_addr);
+    port = ((const struct sockaddr_in *)addr)->sin_port;
+  }
+
+  for (size_t i = 0; i < len; i++) hash = (hash ^ bytes[i]) * 16777619u;
+  hash = (hash ^ (port & 0xff)) * 16777619u;
+  hash = (hash ^ (port >> 8)) * 16777619u;
+
+  return hash & (DEMUX_BUCKETS - 1);
+}
+
+/*true if both are the same address and port*/
+static int
+addr_equal (const struct sockaddr *a, const struct sockaddr *b)
+{
+  if (a->sa_family != b->sa_family) return 0;
+
+  if (a->sa_family == AF_INET6) {
+    const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)a, *b6 = (const struct sockaddr_in6 *)b;
+    return a6->sin6_port == b6->sin6_port && memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(struct in6_addr)) == 0;
+  }
+
+  const struct sockaddr_in *a4 = (const struct sockaddr_in *)a, *b4 = (const struct sockaddr_in *)b;
+  return a4->sin_port == b4->sin_port && a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+}
+
+/*the connection of the listener with this peer, NULL if there is none*/
+static microtcp_sock_t *
+listener_find (struct microtcp_listener *listener, const struct sockaddr *addr)
+{
+  for (struct microtcp_demux_node *node = listener->buckets[addr_hash(addr)]; node != NULL; node = node->next) {
+    if (addr_equal(node->conn->destaddr, addr)) return node->conn;
+  }
+  return NULL;
+}
+
+static void
+listener_insert (struct microtcp_listener *listener, microtcp_sock_t *conn)
+{
+  struct microtcp_demux_node **bucket = &listener->buckets[addr_hash(conn->destaddr)];
+
+  conn->pool->node.conn = conn;
+  conn->pool->node.next = *bucket;
+  *bucket = &conn->pool->node;
+  listener->conns++;
+}
+
+static void
+listener_remove (struct microtcp_listener *listener, microtcp_sock_t *conn)
+{
+  struct microtcp_demux_node **link = &listener->buckets[addr_hash(conn->destaddr)];
+
+  while (*link != NULL && *link != &conn->pool->node) link = &(*link)->next;
+  if (*link == NULL) return;
+
+  *link = conn->pool->node.next;
+  listener->conns--;
+}
+
+/*keeps a SYN until microtcp_accept_conn() takes it, a retransmitted SYN is kept once*/
+static void
+listener_backlog_add (struct microtcp_listener *listener, const struct sockaddr *addr, socklen_t addr_len,
+                      const microtcp_header_t *header)
+{
+  struct microtcp_syn *syn;
+
+  for (int i = 0; i < listener->backlog_count; i++) {
+    syn = &listener->backlog[(listener->backlog_head + i) % listener->backlog_max];
+    if (addr_equal((const struct sockaddr *)&syn->addr, addr)) return;
+  }
+
+  /*the backlog is full, the peer will retransmit its SYN*/
+  if (listener->backlog_count == listener->backlog_max) return;
+
+  syn = &listener->backlog[(listener->backlog_head + listener->backlog_count) % listener->backlog_max];
+  memcpy(&syn->addr, addr, MIN(addr_len, sizeof(syn->addr)));
+  syn->addr_len = addr_len;
+  syn->header = *header;
+  listener->backlog_count++;
+}
+
+/*copies a segment in the queue of a connection. a full queue drops it, as a full UDP socket buffer would*/
+static void
+demux_enqueue (microtcp_sock_t *conn, const message_t *mssg, size_t len)
+{
+  struct microtcp_rxbatch *rx = &conn->pool->rx;
+  size_t idx;
+
+  if (rx->q_count == RX_QUEUE_SLOTS || len > sizeof(message_t)) return;
+
+  idx = (rx->q_head + rx->q_count) % RX_QUEUE_SLOTS;
+  memcpy(rx->arena + idx * sizeof(message_t), mssg, len);
+  rx->q_len[idx] = len;
+  rx->q_count++;
+}
+
+/*reads a batch from the shared socket and hands every segment to the queue of its connection. a SYN from a new
+ *peer goes to the backlog and anything else from an unknown peer is dropped.
+ *returns -1 with errno set if nothing arrived (EAGAIN on timeout)*/
+static int
+listener_pump (struct microtcp_listener *listener, int flags)
+{
+  struct microtcp_rxbatch *rx = &listener->rx;
+  const struct sockaddr *src;
+  microtcp_sock_t *conn;
+  message_t *mssg;
+  int nsegs;
+
+  nsegs = rxbatch_recv(listener->sd, rx, flags, listener->rcvtimeo_us);
+  if (nsegs == -1) return -1;
+
+  for (int i = 0; i < nsegs; i++) {
+    src = (const struct sockaddr *)&rx->names[rx->segs[i].msg];
+    mssg = rx->segs[i].mssg;
+
+    if ((conn = listener_find(listener, src)) != NULL) {
+      demux_enqueue(conn, mssg, rx->segs[i].len);
+    } else if (segment_valid(mssg, rx->segs[i].len) && mssg->header.control == SYN) {
+      listener_backlog_add(listener, src, rx->msgs[rx->segs[i].msg].msg_hdr.msg_namelen, &mssg->header);
+    }
+  }
+
+  return 0;
+}
+
+/*the recv_batch() of a connection of a listener: returns up to max segments of its queue, reading from the
+ *shared socket until some arrive or the receive timeout of the socket expires*/
+static int
+demux_recv (microtcp_sock_t *socket, int flags, int max)
+{
+  struct microtcp_listener *listener = socket->listener;
+  struct microtcp_rxbatch *rx = &socket->pool->rx;
+  uint64_t timeout = listener->rcvtimeo_us;
+  uint64_t deadline = now_us() + timeout;
+  uint64_t now;
+  size_t idx;
+  int n;
+
+  /*the segments of the previous call are processed by now*/
+  rx->q_head = (rx->q_head + rx->q_taken) % RX_QUEUE_SLOTS;
+  rx->q_count -= rx->q_taken;
+  rx->q_taken = 0;
+
+  while (rx->q_count == 0) {
+    /*the datagrams of the other connections must not stretch our timeout*/
+    if (timeout != 0 && !(flags & MSG_DONTWAIT)) {
+      now = now_us();
+      if (now >= deadline) {
+        errno = EAGAIN;
+        return -1;
+      }
+      set_recv_timeout(socket, deadline - now);
+    }
+    if (listener_pump(listener, flags) == -1) {
+      if (errno == EINTR) continue;
+      if ((errno == EAGAIN || errno == EWOULDBLOCK) && !(flags & MSG_DONTWAIT) && timeout != 0 && now_us() < deadline) continue;
+      return -1;
+    }
+  }
+
+  for (n = 0; n < (int)rx->q_count && n < max; n++) {
+    idx = (rx->q_head + n) % RX_QUEUE_SLOTS;
+    rx->segs[n].mssg = (message_t *)(rx->arena + idx * sizeof(message_t));
+    rx->segs[n].len = rx->q_len[idx];
+  }
+  rx->q_taken = n;
+
+  return n;
+}
+
+/*asks the kernel for the offloads the socket wants and keeps only the ones it supports*/
+static void
+offload_setup (microtcp_sock_t *socket)
+{
+  int val = socket->gro;
+  int gso_size;
+  socklen_t len = sizeof(gso_size);
+
+  if (socket->gso && getsockopt(socket->sd, SOL_UDP, UDP_SEGMENT, &gso_size, &len) == -1) socket->gso = 0;
+
+  /*the listener decides about GRO on a shared socket*/
+  if (socket->listener != NULL) {
+    socket->gro = socket->listener->gro;
+    return;
+  }
+  /*the slots of a running ring have their receives posted, they keep their layout*/
+  if (socket->pool != NULL && socket->pool->rx.ring != NULL) {
+    socket->gro = socket->pool->rx.gro;
+    return;
+  }
+  if (setsockopt(socket->sd, SOL_UDP, UDP_GRO, &val, sizeof(val)) == -1) socket->gro = 0;
+
+  if (socket->pool == NULL) return;
+  rxbatch_layout(&socket->pool->rx, socket->gro, 0);
+  if (socket->io_uring && socket->state == ESTABLISHED && rxbatch_ring_start(&socket->pool->rx, socket->sd) == -1) {
+    /*no io_uring here, the plain system calls do the job*/
+    socket->io_uring = 0;
+  }
+}
+
+/*the ring that serves the UDP socket of the connection, NULL without io_uring*/
+static struct microtcp_uring *
+socket_ring (const microtcp_sock_t *socket)
+{
+  if (socket->listener != NULL) return socket->listener->rx.ring;
+  return socket->pool != NULL ? socket->pool->rx.ring : NULL;
+}
+
+/*waits for a segment and takes along every other segment that is already queued for the socket.
+ *returns the number of segments received or -1 with errno set (EAGAIN on timeout)*/
+static int
+recv_batch (microtcp_sock_t *socket, int flags)
+{
+  if (socket->listener != NULL) return demux_recv(socket, flags, RX_MAX_SEGS);
+  return rxbatch_recv(socket->sd, &socket->pool->rx, flags, socket->rcvtimeo_us);
+}
+
+/*receives one segment and validates its length and checksum.
+ *returns the payload length or -1 with errno set (EAGAIN on timeout, EBADMSG on a corrupted segment)*/
+static ssize_t
+recv_segment (microtcp_sock_t *socket, message_t *mssg, int flags, struct sockaddr *address, socklen_t *address_len)
+{
+  struct microtcp_rxbatch *rx;
+  ssize_t bytes_received;
+  int nsegs;
+
+  if (socket->listener != NULL) {
+    /*a connection of a listener takes the next segment of its queue*/
+    if (demux_recv(socket, flags, 1) == -1) return -1;
+    bytes_received = socket->pool->rx.segs[0].len;
+    memcpy(mssg, socket->pool->rx.segs[0].mssg, bytes_received);
+    if (address != NULL) {
+      memcpy(address, socket->destaddr, MIN(*address_len, socket->destaddr_len));
+      *address_len = socket->destaddr_len;
+    }
+  } else if (socket->pool != NULL && socket->pool->rx.ring != NULL) {
+    /*the ring owns the receives of sd, the rest of the batch waits for the next call*/
+    rx = &socket->pool->rx;
+    nsegs = rxbatch_recv_ring(rx, flags, socket->rcvtimeo_us);
+    if (nsegs == -1) return -1;
+    bytes_received = rx->segs[0].len;
+    memcpy(mssg, rx->segs[0].mssg, bytes_received);
+    rx->left_first = 1;
+    rx->left = nsegs - 1;
+    if (address != NULL) {
+      memcpy(address, socket->destaddr, MIN(*address_len, socket->destaddr_len));
+      *address_len = socket->destaddr_len;
+    }
+  } else {
+    bytes_received = recvfrom(socket->sd, mssg, sizeof(message_t), flags, address, address_len);
+    if (bytes_received == -1) return -1;
+  }
+
+  if (!segment_valid(mssg, bytes_received))
+  {
+    errno = EBADMSG;
+    return -1;
+  }
+
+  return mssg->header.data_len;
+}
+
+/*allocates the pool of the connection, if the socket does not have one yet, and puts every segment in the free list*/
+static int
+pool_init (microtcp_sock_t *socket)
+{
+  struct microtcp_pool *pool = socket->pool;
+  /*a connection of a listener only keeps the queue the listener fills, the listener receives for it*/
+  size_t arena_len = socket->listener != NULL ? RX_QUEUE_SLOTS * sizeof(message_t) : RX_ARENA_LEN;
+  uint8_t *arena;
+
+  if (pool == NULL) {
+    pool = malloc(sizeof(struct microtcp_pool));
+    if (pool == NULL) return -1;
+    pool->rx.ring = NULL;
+    pool->rx.arena = NULL;
+    pool->rx.arena_len = 0;
+    pool->chunks = NULL;
+    pool->nsegs = 0;
+    socket->pool = pool;
+  } else {
+    for (int kind = 0; kind < TIMER_KINDS; kind++) microtcp_timer_cancel(&pool->timer[kind]);
+    /*the ring starts again when the connection is established*/
+    if (pool->rx.ring != NULL) rxbatch_ring_stop(&pool->rx);
+  }
+  memset(pool->timer, 0, sizeof(pool->timer));
+  microtcp_wheel_init(&pool->wheel, now_us());
+  pool->timers = &pool->wheel;
+
+  if (pool->rx.arena_len != arena_len) {
+    if ((arena = realloc(pool->rx.arena, arena_len)) == NULL) return -1;
+    pool->rx.arena = arena;
+    pool->rx.arena_len = arena_len;
+  }
+
+  /*the segments of the chunks we already have are all free again*/
+  pool->free_segs = NULL;
+  for (struct microtcp_txchunk *chunk = pool->chunks; chunk != NULL; chunk = chunk->next) {
+    for (int i = TXQ_CHUNK_SEGS - 1; i >= 0; i--) {
+      chunk->segs[i].next = pool->free_segs;
+      pool->free_segs = &chunk->segs[i];
+    }
+  }
+  memset(&pool->ctl, 0, sizeof(pool->ctl));
+  pool->zerocopy = 0;
+  pool->zc_sent = 0;
+  pool->zc_done = 0;
+  pool->zc_queued = 0;
+  if (socket->listener != NULL) {
+    pool->rx.q_head = 0;
+    pool->rx.q_count = 0;
+    pool->rx.q_taken = 0;
+  } else {
+    rxbatch_layout(&pool->rx, socket->gro, 0);
+  }
+
+  return 0;
+}
+
+/*gives back the memory of the connection when it closes*/
+static void
+pool_free (microtcp_sock_t *socket)
+{
+  if (socket->listener != NULL && socket->pool != NULL) listener_remove(socket->listener, socket);
+  if (socket->pool != NULL) {
+    /*the wheel of a loop must not keep the timers of a freed connection*/
+    for (int kind = 0; kind < TIMER_KINDS; kind++) microtcp_timer_cancel(&socket->pool->timer[kind]);
+    if (socket->pool->rx.ring != NULL) rxbatch_ring_stop(&socket->pool->rx);
+    free(socket->pool->rx.arena);
+    while (socket->pool->chunks != NULL) {
+      struct microtcp_txchunk *chunk = socket->pool->chunks;
+
+      socket->pool->chunks = chunk->next;
+      free(chunk);
+    }
+  }
+  free(socket->pool);
+  socket->pool = NULL;
+  socket->destaddr = NULL;
+  free(socket->recvbuf);
+  socket->recvbuf = NULL;
+  socket->txq_head = NULL;
+  socket->txq_tail = NULL;
+}
+
+/*arms a timer of the connection in the wheel that serves it*/
+static void
+timer_set (microtcp_sock_t *socket, int kind, uint64_t expires_us)
+{
+  microtcp_timer_t *timer = &socket->pool->timer[kind];
+
+  /*an empty wheel may have stood still for long, it starts again from now*/
+  if (microtcp_wheel_next(socket->pool->timers) == 0) microtcp_wheel_init(socket->pool->timers, now_us());
+
+  timer->owner = socket;
+  timer->kind = kind;
+  microtcp_timer_arm(socket->pool->timers, timer, expires_us);
+  if (kind == TIMER_RTO || kind == TIMER_PERSIST) socket->rto_deadline_us = expires_us;
+}
+
+static void
+timer_stop (microtcp_sock_t *socket, int kind)
+{
+  microtcp_timer_cancel(&socket->pool->timer[kind]);
+}
+
+static int
+timer_armed (microtcp_sock_t *socket, int kind)
+{
+  return microtcp_timer_armed(&socket->pool->timer[kind]);
+}
+
+/*moves the armed timers of the connection to the wheel of a loop, or back to its own wheel with NULL*/
+static void
+timers_move (microtcp_sock_t *socket, microtcp_wheel_t *wheel)
+{
+  struct microtcp_pool *pool = socket->pool;
+
+  if (wheel == NULL) {
+    /*it stood still while the loop served the socket*/
+    wheel = &pool->wheel;
+    microtcp_wheel_init(wheel, now_us());
+  }
+  pool->timers = wheel;
+
+  for (int kind = 0; kind < TIMER_KINDS; kind++) {
+    if (timer_armed(socket, kind)) microtcp_timer_arm(wheel, &pool->timer[kind], pool->timer[kind].expires_us);
+  }
+}
+
+/*how long a blocking call of the socket waits for segments before the next timer of its wheel, 0 for ever*/
+static uint64_t
+timers_wait_us (microtcp_sock_t *socket)
+{
+  uint64_t next = microtcp_wheel_next(socket->pool->timers);
+  uint64_t now = now_us();
+
+  if (next == 0) return 0;
+  return next > now ? next - now : 1;
+}
+
+/*a wait of a blocking call cut at the deadline of the user timeout, give_up is 0 if the call waits for ever*/
+static uint64_t
+user_wait_us (uint64_t wait, uint64_t give_up)
+{
+  uint64_t now = now_us();
+
+  if (give_up == 0) return wait;
+  if (give_up <= now) return 1;
+  return (wait == 0 || wait > give_up - now) ? give_up - now : wait;
+}
+
+/*the rate of the pacing in bytes per second: the one of the congestion control if it has one, otherwise the cwnd
+ *over the RTT, twice that in slow start so the window can still double every round trip. 0 until the first RTT*/
+static uint64_t
+pace_rate (microtcp_sock_t *socket)
+{
+  uint64_t rate = socket->cc->pacing_rate(socket);
+
+  if (rate != 0) return rate;
+  if (socket->srtt_us == 0) return 0;
+
+  rate = (uint64_t)socket->cwnd * 1000000 / socket->srtt_us;
+  return socket->cwnd < socket->ssthresh ? 2 * rate : rate * 6 / 5;
+}
+
+/*true if the pacing lets a new segment leave now*/
+static int
+pace_ready (microtcp_sock_t *socket)
+{
+  return !socket->pacing || socket->pace_next_us <= now_us();
+}
+
+/*a segment of len bytes left at now: the next one may leave once the rate paid for this one. the time that the
+ *socket did not use is kept for one burst, so a batch still goes out with one sendmmsg*/
+static void
+pace_sent (microtcp_sock_t *socket, size_t len, uint64_t now)
+{
+  uint64_t rate;
+
+  if (!socket->pacing || (rate = pace_rate(socket)) == 0) return;
+
+  if (socket->pace_next_us + MICROTCP_PACING_BURST_US < now) socket->pace_next_us = now - MICROTCP_PACING_BURST_US;
+  socket->pace_next_us += len * 1000000 / rate;
+}
+
+/*sleeps until the pacing lets the next segment leave, or a timer of the connection expires before. the timeout
+ *of the UDP socket counts in jiffies and would turn the gaps of the pacing into bursts*/
+static void
+pace_sleep (microtcp_sock_t *socket)
+{
+  struct timespec ts;
+  uint64_t until = socket->pace_next_us;
+  uint64_t next = microtcp_wheel_next(socket->pool->timers);
+
+  if (next != 0 && next < until) until = next;
+
+  ts.tv_sec = until / 1000000;
+  ts.tv_nsec = (until % 1000000) * 1000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+/*true if seg_alloc() has a segment to give, from the free list or from a new chunk*/
+static int
+seg_available (microtcp_sock_t *socket)
+{
+  return socket->pool->free_segs != NULL || socket->pool->nsegs + TXQ_CHUNK_SEGS <= MICROTCP_TXQ_SEGS;
+}
+
+/*takes a segment from the free list, which grows by a chunk while the pool is below MICROTCP_TXQ_SEGS.
+ *NULL if all of them are in flight*/
+static microtcp_txseg_t *
+seg_alloc (microtcp_sock_t *socket)
+{
+  struct microtcp_pool *pool = socket->pool;
+  struct microtcp_txchunk *chunk;
+  microtcp_txseg_t *seg;
+
+  if (pool->free_segs == NULL && seg_available(socket)) {
+    chunk = malloc(sizeof(struct microtcp_txchunk));
+    if (chunk == NULL) return NULL;
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+    pool->nsegs += TXQ_CHUNK_SEGS;
+    for (int i = TXQ_CHUNK_SEGS - 1; i >= 0; i--) {
+      chunk->segs[i].next = pool->free_segs;
+      pool->free_segs = &chunk->segs[i];
+    }
+  }
+
+  seg = pool->free_segs;
+  if (seg != NULL) pool->free_segs = seg->next;
+
+  return seg;
+}
+
+/*puts an ACKed segment back in the free list*/
+static void
+seg_free (microtcp_sock_t *socket, microtcp_txseg_t *seg)
+{
+  if (seg->zc_data != NULL) socket->pool->zc_queued -= seg->mssg.header.data_len;
+  seg->zc_data = NULL;
+  seg->next = socket->pool->free_segs;
+  socket->pool->free_segs = seg;
+}
+
+/*the i-th segment of the last recv_batch() or NULL if its lengths do not add up, the checksum is left to the caller*/
+static message_t *
+batch_segment_unchecked (microtcp_sock_t *socket, int i)
+{
+  message_t *mssg = socket->pool->rx.segs[i].mssg;
+
+  return segment_sane(mssg, socket->pool->rx.segs[i].len) ? mssg : NULL;
+}
+
+/*sends every segment of the batch with as few sendmmsg calls as the kernel allows. with GSO every run of
+ *full segments, together with the shorter segment that ends it, leaves as one buffer the kernel cuts at GSO_SIZE*/
+static int
+batch_flush (microtcp_sock_t *socket, tx_batch_t *batch, int flags)
+{
+  struct microtcp_uring *ring = socket_ring(socket);
+  struct msghdr *hdr;
+  struct cmsghdr *cmsg;
+  uint16_t gso_size = GSO_SIZE;
+  int nmsgs = 0, sent = 0, n, first, segs, off, max_segs;
+
+  /*the pages of the application are handed to the kernel instead of copied, it reports when it is done with them*/
+  if (batch->zerocopy && socket->pool->zerocopy == 1) flags |= MSG_ZEROCOPY;
+  max_segs = (flags & MSG_ZEROCOPY) ? GSO_MAX_SEGS_ZC : (int)GSO_MAX_SEGS;
+
+  for (int i = 0; i < batch->count; i += segs) {
+    segs = 1;
+    if (socket->gso) {
+      while (i + segs < batch->count && segs < max_segs && batch->lens[i + segs - 1] == GSO_SIZE)
+        segs++;
+    }
+
+    batch->first_seg[nmsgs] = i;
+    hdr = &batch->msgs[nmsgs++].msg_hdr;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->msg_name = (void *)socket->destaddr;
+    hdr->msg_namelen = socket->destaddr_len;
+    hdr->msg_iov = &batch->iovs[batch->seg_iov[i]];
+    hdr->msg_iovlen = batch->seg_iov[i + segs] - batch->seg_iov[i];
+
+    if (segs > 1) {
+      hdr->msg_control = batch->ctrl[nmsgs - 1];
+      hdr->msg_controllen = sizeof(batch->ctrl[nmsgs - 1]);
+      cmsg = CMSG_FIRSTHDR(hdr);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(gso_size));
+      memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+    }
+  }
+
+  while (sent < nmsgs) {
+    if (ring != NULL)
+      n = microtcp_uring_sendmsgs(ring, batch->msgs + sent, nmsgs - sent, flags);
+    else
+      n = sendmmsg(socket->sd, batch->msgs + sent, nmsgs - sent, flags);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      if ((flags & MSG_ZEROCOPY) && (errno == ENOBUFS || errno == EMSGSIZE)) {
+        /*too many completions are not taken yet or the buffer has too many fragments, the kernel copies the rest*/
+        flags &= ~MSG_ZEROCOPY;
+        continue;
+      }
+      if (socket->gso && (errno == EIO || errno == EINVAL)) {
+        /*the route cannot segment, send the rest one datagram per segment from now on*/
+        socket->gso = 0;
+        first = batch->first_seg[sent];
+        off = batch->seg_iov[first];
+        memmove(batch->iovs, batch->iovs + off, (batch->seg_iov[batch->count] - off) * sizeof(struct iovec));
+        for (int i = first; i <= batch->count; i++) {
+          batch->seg_iov[i - first] = batch->seg_iov[i] - off;
+          if (i < batch->count) batch->lens[i - first] = batch->lens[i];
+        }
+        batch->count -= first;
+        return batch_flush(socket, batch, flags);
+      }
+      printf("Error in sending the message to server\n");
+      fprintf(stderr, "Error: %s\n", strerror(errno));
+      return -1;
+    }
+    if (flags & MSG_ZEROCOPY) socket->pool->zc_sent += n;
+    sent += n;
+  }
+  batch->count = 0;
+  batch->zerocopy = 0;
+
+  return 0;
+}
+
+/*adds an already checksummed segment to the batch, the segment must stay in place until the batch is flushed.
+ *payload is NULL if the payload follows the header in mssg, otherwise the segment is sent from both places*/
+static int
+batch_add (microtcp_sock_t *socket, tx_batch_t *batch, const message_t *mssg, const uint8_t *payload, int flags)
+{
+  struct iovec *iov;
+
+  if (batch->count == MICROTCP_BATCH && batch_flush(socket, batch, flags) == -1) return -1;
+
+  if (batch->count == 0) batch->seg_iov[0] = 0;
+  iov = &batch->iovs[batch->seg_iov[batch->count]];
+  iov->iov_base = (void *)mssg;
+  iov->iov_len = MICROTCP_SEGMENT_LEN(mssg);
+  if (payload != NULL) {
+    iov->iov_len -= mssg->header.data_len;
+    iov++;
+    iov->iov_base = (void *)payload;
+    iov->iov_len = mssg->header.data_len;
+    batch->zerocopy = 1;
+  }
+  batch->lens[batch->count] = MICROTCP_SEGMENT_LEN(mssg);
+  batch->seg_iov[batch->count + 1] = iov + 1 - batch->iovs;
+  batch->count++;
+
+  return 0;
+}
+
+microtcp_sock_t
+microtcp_socket (int domain, int type, int protocol)
+{
+  microtcp_sock_t mysocket;
+  int nonblock = (type & MICROTCP_NONBLOCK) != 0;
+  int io_uring = (type & MICROTCP_IO_URING) != 0;
+  int bufsize = MICROTCP_RECVBUF_MAX;
+  int sock;
+
+  /*the UDP socket stays blocking, the non-blocking calls pass MSG_DONTWAIT.
+   *the ring starts once the connection is established*/
+  if ((sock = socket(domain, type & ~(MICROTCP_NONBLOCK | MICROTCP_IO_URING), protocol)) == -1)
+  {
+    printf(" SOCKET COULD NOT BE OPENED \n");
+    exit(EXIT_FAILURE);
+  }
+
+  /*a window of data can arrive back to back, room for it in the UDP socket or the burst is lost.
+   *the kernel caps it at net.core.rmem_max and wmem_max*/
+  setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+  setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+
+  memset(&mysocket, 0, sizeof(mysocket));
+
+  mysocket.sd = sock;
+  mysocket.state = INIT;
+  mysocket.rto_us = MICROTCP_ACK_TIMEOUT_US;
+  mysocket.cc = &microtcp_cc_reno;
+  mysocket.gso = 1;
+  mysocket.gro = 1;
+  mysocket.recvbuf_len = MICROTCP_RECVBUF_LEN;
+  mysocket.recvbuf_autotune = 1;
+  mysocket.nonblock = nonblock;
+  mysocket.io_uring = io_uring;
+
+  return mysocket;
+}
+
+int
+microtcp_bind (microtcp_sock_t *socket, const struct sockaddr *address,
+               socklen_t address_len)
+{
+  if (address == NULL || socket == NULL)
+  {
+    printf("Invalid input in microtcp_bind\n");
+    return -1;
+  }
+
+  if (bind(socket->sd, address, address_len) == -1)
+  {
+    printf("Error in binding, closing the socket.\n");
+    return -1;
+  }
+
+  socket->state = LISTEN;
+  //socket->myaddr = address;
+
+  return 0; /*the binding was successful*/
+}
+
+int
+microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address,
+                  socklen_t address_len)
+{
+  srand(time(NULL));   /*to create a random sequence number on each run*/
+
+  message_t *mssg;
+  uint64_t syn_sent;
+
+  /*every buffer the connection needs is allocated here, once*/
+  if (pool_init(socket) == -1) return -1;
+  mssg = &socket->pool->ctl;
+
+  /*here client knows server's adress which is its destination address, the socket keeps a copy of it*/
+  memcpy(&socket->pool->peer, address, MIN(address_len, sizeof(socket->pool->peer)));
+  socket->destaddr = (const struct sockaddr *)&socket->pool->peer;
+  socket->destaddr_len = address_len;
+  
+  /*make message*/
+  mssg->header.seq_number = (uint32_t)(rand() % 10);
+  socket->seq_number = mssg->header.seq_number;
+  mssg->header.control = SYN;
+  /*the windows of the SYN and the SYN ACK are never scaled*/
+  socket->rcv_wscale = 0;
+  socket->snd_wscale = 0;
+  mssg->header.window = rcv_window(socket);
+  mssg->header.future_use0 = MICROTCP_OPT_SACK_PERMITTED | MICROTCP_OPT_WSCALE(wscale_pick(socket));
+  socket->init_win_size = mssg->header.window;
+
+  printf("Sending SYN, seq=%d, win=%d\n", mssg->header.seq_number, mssg->header.window);
+
+  syn_sent = now_us();
+  if (send_segment(socket, mssg, 0) == -1)
+  {
+    printf("Error in sending the message from socket <%d>\n", socket->sd);
+    return -1;
+  }
+
+  printf("MESSAGE SENT\n");
+
+  /*without a user timeout the wait is for ever*/
+  sd_set_timeout(socket->sd, &socket->rcvtimeo_us, socket->user_timeout_us);
+  if (recv_segment(socket, mssg, 0, NULL, NULL) == -1)
+  {
+    printf("Error in receiving the message in socket <%d>\n", socket->sd);
+    return -1;
+  }
+
+  printf("Received ??, seq=%d, ack=%d\n", mssg->header.seq_number, mssg->header.ack_number);
+
+  if (mssg->header.control != (SYN | ACK)) return -1;
+
+  /*the SYN and the SYN ACK give us the first RTT sample*/
+  rtt_sample(socket, now_us() - syn_sent);
+
+  printf("Received SYN ACK with win=%d\n", mssg->header.window);
+
+  socket->curr_win_size = mssg->header.window; /*fixing curr_win_size of client according to what the server sent to him*/
+  socket->sack_permitted = (mssg->header.future_use0 & MICROTCP_OPT_SACK_PERMITTED) != 0;
+
+  /*the windows are scaled from now on, only if the server answered with its own scale*/
+  if (mssg->header.future_use0 & MICROTCP_OPT_WSCALE_PRESENT) {
+    socket->snd_wscale = MIN(MICROTCP_OPT_WSCALE_SHIFT(&mssg->header), MICROTCP_MAX_WSCALE);
+    socket->rcv_wscale = wscale_pick(socket);
+  }
+
+  /*making next message*/
+  mssg->header.ack_number = mssg->header.seq_number + 1;
+  socket->ack_number = mssg->header.ack_number;
+  mssg->header.seq_number = socket->seq_number + 1;
+  socket->seq_number = socket->seq_number + 1;
+  mssg->header.window = rcv_window(socket);
+  mssg->header.control = mssg->header.control & (~(SYN)); /*we are "subtracting" the SYN flag*/
+  mssg->header.future_use0 = 0;
+
+  printf("Sending ACK, seq=%d, ack=%d\n", mssg->header.seq_number, mssg->header.ack_number);
+  if (send_segment(socket, mssg, 0) == -1)
+  {
+    printf("Error in sending the message from socket <%d>\n", socket->sd);
+    return -1;
+  }
+
+  socket->state = ESTABLISHED;
+
+  /*allocate memory for recvbuf and initialize the window values accordingly*/
+  if (recvbuf_init(socket) == -1) return -1;
+  socket->snd_una = socket->seq_number;
+  socket->recover = socket->seq_number;
+  socket->cc->init(socket);
+  offload_setup(socket);
+
+  return 0; /*the connection was successful*/
+}
+
+/*the server side of the handshake, after the SYN in mssg: answers with a SYN ACK and waits for the ACK*/
+static int
+accept_syn (microtcp_sock_t *socket, message_t *mssg)
+{
+  uint64_t synack_sent;
+
+  printf("Received SYN with win=%d\n", mssg->header.window);
+
+  /*make message*/
+  mssg->header.ack_number = mssg->header.seq_number + 1;
+  socket->ack_number = mssg->header.ack_number;
+  mssg->header.seq_number = (uint32_t)(rand() % 10);
+  socket->seq_number = mssg->header.seq_number;
+  mssg->header.control = mssg->header.control | ACK; /*making the SYN ACK flag only with the |ACK because the header has already the SYN in it*/
+  socket->rcv_wscale = 0;
+  socket->snd_wscale = 0;
+  mssg->header.window = rcv_window(socket);
+  /*we answer with SACK permitted and our window scale only if the client asked for them*/
+  socket->sack_permitted = (mssg->header.future_use0 & MICROTCP_OPT_SACK_PERMITTED) != 0;
+  if (mssg->header.future_use0 & MICROTCP_OPT_WSCALE_PRESENT) {
+    socket->snd_wscale = MIN(MICROTCP_OPT_WSCALE_SHIFT(&mssg->header), MICROTCP_MAX_WSCALE);
+    socket->rcv_wscale = wscale_pick(socket);
+  }
+  mssg->header.future_use0 = (socket->sack_permitted ? MICROTCP_OPT_SACK_PERMITTED : 0)
+                             | ((mssg->header.future_use0 & MICROTCP_OPT_WSCALE_PRESENT) ? MICROTCP_OPT_WSCALE(socket->rcv_wscale) : 0);
+  socket->init_win_size = mssg->header.window;
+
+  printf("Sending SYN ACK, seq=%d, ack=%d, win=%d\n", mssg->header.seq_number, mssg->header.ack_number, mssg->header.window);
+  synack_sent = now_us();
+  if (send_segment(socket, mssg, 0) == -1)
+  {
+    printf("Error in sending the message from socket <%d>\n", socket->sd);
+    fprintf(stderr, "Error: %s\n", strerror(errno));
+    return -1;
+  }
+
+  if (recv_segment(socket, mssg, 0, NULL, NULL) == -1)
+  {
+    printf("Error in receiving the message in socket <%d>\n", socket->sd);
+    return -1;
+  }
+
+  printf("Received ??, seq=%d, ack=%d\n", mssg->header.seq_number, mssg->header.ack_number);
+
+  if (mssg->header.control != (ACK)) return -1;
+
+  /*the SYN ACK and the ACK give us the first RTT sample*/
+  rtt_sample(socket, now_us() - synack_sent);
+  
+  printf("Received ACK\n");
+
+  socket->state = ESTABLISHED;
+  /*the SYN ACK took a sequence number, our data starts after it as the client expects*/
+  socket->seq_number = socket->seq_number + 1;
+
+  /*allocate memory for recvbuf and initialize the window values accordingly*/
+  if (recvbuf_init(socket) == -1) return -1;
+  socket->curr_win_size = (size_t)mssg->header.window << socket->snd_wscale;
+  socket->snd_una = socket->seq_number;
+  socket->recover = socket->seq_number;
+  socket->cc->init(socket);
+  offload_setup(socket);
+
+  return 0; /*successful acceptance*/
+}
+
+int
+microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address,
+                 socklen_t address_len)
+{
+  srand(time(NULL));
+
+  message_t *mssg;
+
+  /*every buffer the connection needs is allocated here, once*/
+  if (pool_init(socket) == -1) return -1;
+  mssg = &socket->pool->ctl;
+
+  /*the source of the SYN is the destination address of the connection, the socket keeps a copy of it*/
+  socket->destaddr = (const struct sockaddr *)&socket->pool->peer;
+  socket->destaddr_len = sizeof(socket->pool->peer);
+
+  printf("WAITING TO ACCEPT\n");
+
+  /*without a user timeout the wait is for ever*/
+  sd_set_timeout(socket->sd, &socket->rcvtimeo_us, socket->user_timeout_us);
+  if (recv_segment(socket, mssg, 0, (struct sockaddr *)&socket->pool->peer, &socket->destaddr_len) == -1)
+  {
+    printf("Error in receiving the message in socket <%d>\n", socket->sd);
+    fprintf(stderr, "Error: %s\n", strerror(errno));
+    return -1;
+  }
+
+  printf("MESSAGE RECEIVED\n");
+
+  if (address != NULL) memcpy(address, &socket->pool->peer, MIN(address_len, socket->destaddr_len));
+
+  printf("Received ??, seq=%d, win=%d\n", mssg->header.seq_number, mssg->header.window);
+
+  if (mssg->header.control != (SYN)) {
+    printf("SYN: %d\nWe got: %d\n", SYN, mssg->header.window);  
+    return -1;
+  }
+
+  return accept_syn(socket, mssg);
+}
+
+int
+microtcp_listen (microtcp_sock_t *socket, int backlog)
+{
+  struct microtcp_listener *listener;
+  int val = 1;
+
+  if (backlog <= 0 || socket->state != LISTEN || socket->listener != NULL) return -1;
+
+  listener = calloc(1, sizeof(struct microtcp_listener));
+  if (listener == NULL) return -1;
+  listener->backlog = calloc(backlog, sizeof(struct microtcp_syn));
+  if (listener->backlog == NULL) {
+    free(listener);
+    return -1;
+  }
+  listener->backlog_max = backlog;
+  listener->sd = socket->sd;
+  listener->rx.arena = malloc(RX_ARENA_LEN);
+  if (listener->rx.arena == NULL) {
+    free(listener->backlog);
+    free(listener);
+    return -1;
+  }
+  listener->rx.arena_len = RX_ARENA_LEN;
+
+  /*every connection shares the socket, so GRO is decided once for all of them*/
+  listener->gro = socket->gro;
+  if (listener->gro && setsockopt(socket->sd, SOL_UDP, UDP_GRO, &val, sizeof(val)) == -1) listener->gro = 0;
+  rxbatch_layout(&listener->rx, listener->gro, 1);
+  if (socket->io_uring && rxbatch_ring_start(&listener->rx, listener->sd) == -1) socket->io_uring = 0;
+
+  socket->listener = listener;
+
+  return 0;
+}
+
+int
+microtcp_accept_conn (microtcp_sock_t *socket, microtcp_sock_t *conn, struct sockaddr *address,
+                      socklen_t *address_len)
+{
+  struct microtcp_listener *listener = socket->listener;
+  struct microtcp_syn *syn;
+
+  if (socket->state != LISTEN || listener == NULL) return -1;
+
+  if (!socket->nonblock) printf("WAITING TO ACCEPT\n");
+
+  /*the segments of the connections we already have are queued while we wait*/
+  sd_set_timeout(listener->sd, &listener->rcvtimeo_us, 0);
+  while (listener->backlog_count == 0) {
+    if (listener_pump(listener, socket->nonblock ? MSG_DONTWAIT : 0) == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        if (socket->nonblock) return -1;
+        continue;
+      }
+      printf("Error in receiving the message in socket <%d>\n", socket->sd);
+      fprintf(stderr, "Error: %s\n", strerror(errno));
+      return -1;
+    }
+  }
+  syn = &listener->backlog[listener->backlog_head];
+  listener->backlog_head = (listener->backlog_head + 1) % listener->backlog_max;
+  listener->backlog_count--;
+
+  memset(conn, 0, sizeof(*conn));
+  conn->sd = listener->sd;
+  conn->state = INIT;
+  conn->rto_us = MICROTCP_ACK_TIMEOUT_US;
+  conn->cc = socket->cc;
+  conn->gso = socket->gso;
+  conn->gro = listener->gro;
+  conn->recvbuf_len = socket->recvbuf_len;
+  conn->recvbuf_autotune = socket->recvbuf_autotune;
+  conn->nonblock = socket->nonblock;
+  conn->user_timeout_us = socket->user_timeout_us;
+  conn->listener = listener;
+
+  if (pool_init(conn) == -1) return -1;
+  memcpy(&conn->pool->peer, &syn->addr, sizeof(syn->addr));
+  conn->destaddr = (const struct sockaddr *)&conn->pool->peer;
+  conn->destaddr_len = syn->addr_len;
+  listener_insert(listener, conn);
+
+  conn->pool->ctl.header = syn->header;
+  if (address != NULL && address_len != NULL) {
+    memcpy(address, &syn->addr, MIN(*address_len, syn->addr_len));
+    *address_len = syn->addr_len;
+  }
+
+  if (accept_syn(conn, &conn->pool->ctl) == -1) {
+    pool_free(conn);
+    conn->state = INVALID;
+    return -1;
+  }
+
+  return 0;
+}
+
+int
+microtcp_set_reuseport (microtcp_sock_t *socket)
+{
+  int val = 1;
+
+  if (socket->state != INIT) return -1;
+
+  return setsockopt(socket->sd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
+}
+
+/*the CPU of the worker: the workers go round the CPUs the process may run on, -1 if we cannot tell which*/
+static int
+worker_cpu (int id)
+{
+  cpu_set_t allowed;
+  int n;
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1 || CPU_COUNT(&allowed) == 0) return -1;
+
+  n = id % CPU_COUNT(&allowed);
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &allowed) && n-- == 0) return cpu;
+  }
+  return -1;
+}
+
+static void *
+worker_main (void *arg)
+{
+  struct microtcp_worker *worker = arg;
+  struct microtcp_gate *gate = worker->gate;
+  cpu_set_t set;
+  int state;
+
+  pthread_mutex_lock(&gate->lock);
+  while (gate->state == 0) pthread_cond_wait(&gate->cond, &gate->lock);
+  state = gate->state;
+  pthread_mutex_unlock(&gate->lock);
+  if (state == -1) return NULL;
+
+  if (worker->cpu != -1) {
+    CPU_ZERO(&set);
+    CPU_SET(worker->cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) printf("Worker %d runs unpinned\n", worker->id);
+  }
+
+  worker->fn(&worker->listener, worker->id, worker->arg);
+  return NULL;
+}
+
+int
+microtcp_serve (const struct sockaddr *address, socklen_t address_len, int workers, int backlog, int type,
+                microtcp_worker_fn fn, void *arg)
+{
+  struct microtcp_worker *pool;
+  struct microtcp_gate gate = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 };
+  int ready = 0, started = 0, ret = 0;
+
+  if (address == NULL || workers <= 0 || fn == NULL) return -1;
+
+  pool = calloc(workers, sizeof(struct microtcp_worker));
+  if (pool == NULL) return -1;
+
+  /*every socket joins the group before a worker runs, from then on the kernel hands the datagrams of a peer
+   *always to the same socket, so a connection never leaves the thread that accepted it*/
+  for (; ready < workers; ready++) {
+    pool[ready].listener = microtcp_socket(address->sa_family, type, 0);
+    if (microtcp_set_reuseport(&pool[ready].listener) == -1
+        || microtcp_bind(&pool[ready].listener, address, address_len) == -1
+        || microtcp_listen(&pool[ready].listener, backlog) == -1)
+    {
+      fprintf(stderr, "Error in setting up worker %d: %s\n", ready, strerror(errno));
+      close(pool[ready].listener.sd);
+      ret = -1;
+      break;
+    }
+    pool[ready].gate = &gate;
+    pool[ready].id = ready;
+    pool[ready].cpu = worker_cpu(ready);
+    pool[ready].fn = fn;
+    pool[ready].arg = arg;
+  }
+
+  for (; ret == 0 && started < workers; started++) {
+    if (pthread_create(&pool[started].thread, NULL, worker_main, &pool[started]) != 0) {
+      printf("Error in starting worker %d\n", started);
+      ret = -1;
+      break;
+    }
+  }
+
+  /*the workers that started run only if all of them did, else they return before they touch their listener*/
+  pthread_mutex_lock(&gate.lock);
+  gate.state = ret == 0 ? 1 : -1;
+  pthread_cond_broadcast(&gate.cond);
+  pthread_mutex_unlock(&gate.lock);
+
+  for (int i = 0; i < started; i++) pthread_join(pool[i].thread, NULL);
+
+  for (int i = 0; i < ready; i++) {
+    microtcp_shutdown(&pool[i].listener, SHUT_RDWR);
+    close(pool[i].listener.sd);
+  }
+  free(pool);
+
+  return ret;
+}
+
+/*takes the next contiguous piece of the iovecs, *len bytes at most, and sets *len to its length*/
+static const uint8_t *
+cursor_take (iov_cursor_t *src, size_t *len)
+{
+  const uint8_t *piece;
+
+  while (src->off == src->iov->iov_len) {
+    src->iov++;
+    src->iovcnt--;
+    src->off = 0;
+  }
+  piece = (const uint8_t *)src->iov->iov_base + src->off;
+  *len = MIN(*len, src->iov->iov_len - src->off);
+  src->off += *len;
 
-/*our global vars*/
-const struct sockaddr *cl, *sr;
-socklen_t cl_len = sizeof(struct sockaddr_in), sr_len = sizeof(struct sockaddr);
+  return piece;
+}
 
-microtcp_sock_t
-microtcp_socket (int domain, int type, int protocol)
+/*makes a segment with the next len bytes of src, appends it to the retransmission queue and adds it to the batch.
+ *the payload may span many iovecs. with zerocopy src is a single buffer and the segment keeps pointing at it
+ *instead of a copy*/
+static int
+txq_push (microtcp_sock_t *socket, tx_batch_t *batch, iov_cursor_t *src, size_t len, int zerocopy, int flags)
 {
-  microtcp_sock_t mysocket;
-  int sock;
-  if ((sock = socket(domain, type, protocol)) == -1)
-  {
-    printf(" SOCKET COULD NOT BE OPENED \n");
-    exit(EXIT_FAILURE);
+  microtcp_txseg_t *seg = seg_alloc(socket);
+  const uint8_t *data;
+  size_t piece;
+  uint32_t crc;
+
+  if (seg == NULL) return -1;
+
+  /*make header*/
+  memset(&seg->mssg.header, 0, sizeof(microtcp_header_t));
+  seg->mssg.header.control = ACK;
+  seg->mssg.header.ack_number = socket->ack_number;
+  seg->mssg.header.seq_number = socket->seq_number;
+  seg->mssg.header.window = rcv_window(socket);
+  socket->rcv_adv = seg->mssg.header.window;
+  seg->mssg.header.data_len = len;
+
+  /*the segment carries the ACK that waited*/
+  socket->rcv_acked = socket->ack_number;
+  timer_stop(socket, TIMER_DELACK);
+
+  /*the payload is checksummed while it is copied in the segment, or only read if it stays where it is*/
+  crc = update_crc32(0xffffffff, (const uint8_t *)&seg->mssg.header, sizeof(microtcp_header_t));
+  if (zerocopy) {
+    piece = len;
+    data = cursor_take(src, &piece);
+    crc = update_crc32(crc, data, len);
+    seg->zc_data = data;
+    socket->pool->zc_queued += len;
+  } else {
+    for (size_t copied = 0; copied < len; copied += piece) {
+      piece = len - copied;
+      data = cursor_take(src, &piece);
+      crc = update_crc32_copy(crc, seg->mssg.data + copied, data, piece);
+    }
+    seg->zc_data = NULL;
+  }
+  seg->mssg.header.checksum = crc ^ 0xffffffff;
+  seg->next = NULL;
+  seg->sacked = 0;
+  seg->rtx_epoch = 0;
+  seg->sent_us = now_us();
+  pace_sent(socket, len, seg->sent_us);
+
+  /*the retransmission timer runs while there is data in flight, it takes over from the persist timer*/
+  if (socket->txq_head == NULL) {
+    timer_set(socket, TIMER_RTO, seg->sent_us + socket->rto_us);
+    timer_stop(socket, TIMER_PERSIST);
   }
 
-  memset(&mysocket, 0, sizeof(mysocket));
+  if (socket->txq_tail == NULL) socket->txq_head = seg;
+  else socket->txq_tail->next = seg;
+  socket->txq_tail = seg;
 
-  mysocket.sd = sock;
-  mysocket.state = INIT;
+  if (batch_add(socket, batch, &seg->mssg, seg->zc_data, flags) == -1) return -1;
 
-  return mysocket;
+  /*update socket's values to be used on next header*/
+  socket->bytes_send += len;
+  socket->packets_send++;
+  socket->seq_number += len;
+
+  return 0;
 }
 
-int
-microtcp_bind (microtcp_sock_t *socket, const struct sockaddr *address,
-               socklen_t address_len)
+/*retransmition logic: the receiver keeps the segments that arrive after a gap and reports them with SACK blocks,
+ *so we send again only the holes: the oldest segment that is not ACKed and every segment below the highest
+ *SACKed byte that the receiver does not have. Each hole is sent once in every loss recovery*/
+static int
+retransmit_holes (microtcp_sock_t *socket, int flags)
 {
-  if (address == NULL || socket == NULL)
-  {
-    printf("Invalid input in microtcp_bind\n");
-    return -1;
+  tx_batch_t batch;
+
+  batch.count = 0;
+  batch.zerocopy = 0;
+  for (microtcp_txseg_t *seg = socket->txq_head; seg != NULL; seg = seg->next) {
+    if (seg != socket->txq_head && SEQ_GEQ(seg->mssg.header.seq_number, socket->sack_high)) break;
+    if (seg->sacked || seg->rtx_epoch == socket->rtx_epoch) continue;
+
+    if (batch_add(socket, &batch, &seg->mssg, seg->zc_data, flags) == -1) return -1;
+    seg->rtx_epoch = socket->rtx_epoch;
+    socket->packets_lost++;
+    socket->bytes_lost += seg->mssg.header.data_len;
   }
 
-  if (bind(socket->sd, address, address_len) == -1)
+  return batch_flush(socket, &batch, flags);
+}
+
+/*enters loss recovery: until everything sent so far is ACKed, no other fast retransmit happens because of
+ *the dupACKs of the segments that are already in flight*/
+static int
+enter_recovery (microtcp_sock_t *socket, int flags)
+{
+  socket->recover = socket->seq_number;
+  socket->dupACKs = 0;
+  socket->rtx_epoch++;
+
+  return retransmit_holes(socket, flags);
+}
+
+/*marks the segments of the retransmission queue that the SACK blocks of the ACK cover.
+ *returns how many segments were SACKed for the first time*/
+static int
+sack_mark (microtcp_sock_t *socket, const message_t *recvmssg)
+{
+  const microtcp_ooo_block_t *blocks = (const microtcp_ooo_block_t *)recvmssg->data;
+  int nblocks = MICROTCP_OPT_SACK_BLOCKS(&recvmssg->header);
+  uint64_t sample_sent = 0;
+  int newly_sacked = 0;
+
+  for (int i = 0; i < nblocks; i++) {
+    /*ignore blocks outside of what is in flight*/
+    if (SEQ_LEQ(blocks[i].end, socket->snd_una) || SEQ_GT(blocks[i].end, socket->seq_number)) continue;
+
+    for (microtcp_txseg_t *seg = socket->txq_head; seg != NULL; seg = seg->next) {
+      uint32_t seq = seg->mssg.header.seq_number;
+
+      if (SEQ_GEQ(seq, blocks[i].end)) break;
+      if (!seg->sacked && SEQ_GEQ(seq, blocks[i].start) && SEQ_LEQ(seq + seg->mssg.header.data_len, blocks[i].end)) {
+        seg->sacked = 1;
+        newly_sacked++;
+        if (seg->rtx_epoch == 0 && seg->sent_us > sample_sent) sample_sent = seg->sent_us;
+      }
+    }
+    if (SEQ_GT(blocks[i].end, socket->sack_high)) socket->sack_high = blocks[i].end;
+  }
+
+  if (sample_sent != 0) rtt_sample(socket, now_us() - sample_sent);
+
+  return newly_sacked;
+}
+
+/*slides the window: frees every segment of the retransmission queue that is covered by the cumulative ACK.
+ *the newest of them gives an RTT sample, unless it was retransmitted (Karn's algorithm)*/
+static void
+txq_ack (microtcp_sock_t *socket, size_t ack_number)
+{
+  microtcp_txseg_t *seg;
+  uint64_t now = now_us();
+  uint64_t sample_sent = 0;
+
+  while ((seg = socket->txq_head) != NULL
+         && SEQ_LEQ(seg->mssg.header.seq_number + seg->mssg.header.data_len, ack_number)) {
+    /*a SACKed segment gave its sample when it was SACKed*/
+    sample_sent = (seg->rtx_epoch == 0 && !seg->sacked) ? seg->sent_us : 0;
+    socket->txq_head = seg->next;
+    seg_free(socket, seg);
+  }
+  if (socket->txq_head == NULL) socket->txq_tail = NULL;
+
+  if (sample_sent != 0) rtt_sample(socket, now - sample_sent);
+
+  /*new data is ACKed, restart the retransmission timer, or stop it if nothing is left in flight*/
+  if (socket->txq_head != NULL) timer_set(socket, TIMER_RTO, now + socket->rto_us);
+  else timer_stop(socket, TIMER_RTO);
+
+  socket->snd_una = ack_number;
+  if (SEQ_LT(socket->sack_high, ack_number)) socket->sack_high = ack_number;
+}
+
+/*processes an ACK for the data we have sent*/
+static int
+process_ack (microtcp_sock_t *socket, const message_t *recvmssg, int flags)
+{
+  uint32_t ack_number = recvmssg->header.ack_number;
+  int newly_sacked = 0;
+
+  if (!(recvmssg->header.control & ACK)) return 0;
+
+  /*ignore old ACKs and ACKs for data we never sent*/
+  if (SEQ_LT(ack_number, socket->snd_una) || SEQ_GT(ack_number, socket->seq_number)) return 0;
+
+  /*the receiver advertises the free space of its buffer, in units of its scale*/
+  socket->curr_win_size = (size_t)recvmssg->header.window << socket->snd_wscale;
+
+  if (socket->sack_permitted) newly_sacked = sack_mark(socket, recvmssg);
+
+  if (SEQ_GT(ack_number, socket->snd_una)) {
+    size_t acked = (uint32_t)(ack_number - socket->snd_una);
+
+    txq_ack(socket, ack_number);
+    socket->dupACKs = 0;
+    socket->cc->on_ack(socket, acked);
+
+    /*during the recovery a partial ACK or new SACK blocks point to the next holes*/
+    if (SEQ_LT(ack_number, socket->recover) && retransmit_holes(socket, flags) == -1) return -1;
+  } else if (socket->txq_head != NULL && recvmssg->header.data_len == 0) {
+    /*the receiver ACKs a whole batch at once, every segment a SACK reports counts as a dupACK*/
+    socket->dupACKs += newly_sacked > 1 ? newly_sacked : 1;
+
+    if (socket->dupACKs >= 3 && SEQ_GEQ(ack_number, socket->recover)) {
+      /*fast recovery*/
+      fprintf(stderr, "3 duplicate ACKs occured, retransmit missing package\n");
+      socket->cc->on_loss(socket);
+
+      return enter_recovery(socket, flags);
+    }
+
+    if (SEQ_LT(ack_number, socket->recover)) return retransmit_holes(socket, flags);
+  }
+
+  return 0;
+}
+
+/*bytes of the receive buffer that are in use, in-order data and the out-of-order blocks after it*/
+static size_t
+recvbuf_used (microtcp_sock_t *socket)
+{
+  if (socket->ooo_blocks == 0) return socket->buf_fill_level;
+  return socket->buf_fill_level + (uint32_t)(socket->ooo[socket->ooo_blocks - 1].end - socket->ack_number);
+}
+
+/*dynamic right-sizing, as the receive buffer autotuning of Linux: once per RTT, if the application drained
+ *more than half of the buffer the window may be what limits the sender, so the buffer grows to twice what
+ *was drained and the sender can keep doubling its window*/
+static void
+recvbuf_autotune (microtcp_sock_t *socket, size_t delivered)
+{
+  uint64_t now = now_us();
+  size_t len = socket->recvbuf_len;
+  size_t used = recvbuf_used(socket);
+  size_t first;
+  uint8_t *buf;
+
+  socket->rcv_copied += delivered;
+  if (!socket->recvbuf_autotune || now - socket->rcv_epoch_us < MAX(socket->srtt_us, MICROTCP_MIN_RTO_US)) return;
+
+  while (len < MICROTCP_RECVBUF_MAX && len < 2 * socket->rcv_copied) len <<= 1;
+  socket->rcv_copied = 0;
+  socket->rcv_epoch_us = now;
+  if (len == socket->recvbuf_len || (buf = malloc(len)) == NULL) return;
+
+  /*the new ring starts with the data of the old one at the head*/
+  first = MIN(used, socket->recvbuf_len - socket->recvbuf_head);
+  memcpy(buf, socket->recvbuf + socket->recvbuf_head, first);
+  memcpy(buf + first, socket->recvbuf, used - first);
+  free(socket->recvbuf);
+  socket->recvbuf = buf;
+  socket->recvbuf_len = len;
+  socket->recvbuf_head = 0;
+}
+
+/*adds the range [start, end) to the sorted out-of-order blocks, merging it with the blocks it overlaps or touches.
+ *returns -1 if there is no free block to keep it*/
+static int
+ooo_add (microtcp_sock_t *socket, uint32_t start, uint32_t end)
+{
+  microtcp_ooo_block_t *ooo = socket->ooo;
+  int i = 0, j;
+
+  /*skip the blocks that end before the new one*/
+  while (i < socket->ooo_blocks && SEQ_LT(ooo[i].end, start)) i++;
+
+  /*absorb the blocks that overlap or touch the new one*/
+  for (j = i; j < socket->ooo_blocks && SEQ_LEQ(ooo[j].start, end); j++) {
+    if (SEQ_LT(ooo[j].start, start)) start = ooo[j].start;
+    if (SEQ_GT(ooo[j].end, end)) end = ooo[j].end;
+  }
+
+  if (i == j) {
+    if (socket->ooo_blocks == MICROTCP_OOO_MAX_BLOCKS) return -1;
+    memmove(&ooo[i + 1], &ooo[i], (socket->ooo_blocks - i) * sizeof(*ooo));
+    socket->ooo_blocks++;
+  } else {
+    memmove(&ooo[i + 1], &ooo[j], (socket->ooo_blocks - j) * sizeof(*ooo));
+    socket->ooo_blocks -= j - i - 1;
+  }
+  ooo[i].start = start;
+  ooo[i].end = end;
+
+  return 0;
+}
+
+/*true if the range [start, end) overlaps data we keep out of order*/
+static int
+ooo_overlaps (microtcp_sock_t *socket, uint32_t start, uint32_t end)
+{
+  for (int i = 0; i < socket->ooo_blocks; i++) {
+    if (SEQ_LT(start, socket->ooo[i].end) && SEQ_LT(socket->ooo[i].start, end)) return 1;
+  }
+  return 0;
+}
+
+/*places the payload of a data segment in the receive buffer at the offset of its sequence number.
+ *in-order data moves the ACK forward, together with every out-of-order block that the gap filling reaches.
+ *the checksum is verified while the payload is copied, returns -1 if the segment is corrupted, 1 if it has to
+ *be ACKed at once and 0 if its ACK may be delayed*/
+static int
+process_data (microtcp_sock_t *socket, message_t *recvmssg)
+{
+  uint32_t seq = recvmssg->header.seq_number;
+  uint32_t end = seq + recvmssg->header.data_len;
+  uint32_t checksum = recvmssg->header.checksum;
+  const uint8_t *data = MICROTCP_PAYLOAD(recvmssg);
+  size_t offset = 0, skip = 0;
+  int keep = 0, fused = 0, filled;
+  uint32_t crc;
+
+  /*keep only the part after the bytes we already have, if it fits in the window we advertised*/
+  if (SEQ_GT(end, socket->ack_number)) {
+    if (SEQ_LT(seq, socket->ack_number)) skip = (uint32_t)(socket->ack_number - seq);
+    offset = socket->buf_fill_level + (uint32_t)(seq + skip - socket->ack_number);
+    keep = offset + (uint32_t)(end - seq - skip) <= socket->recvbuf_len;
+  }
+
+  /*the header and the options as the sender checksummed them, with the checksum field zeroed*/
+  recvmssg->header.checksum = 0;
+  crc = update_crc32(0xffffffff, (const uint8_t *)recvmssg, data - (const uint8_t *)recvmssg);
+  recvmssg->header.checksum = checksum;
+
+  /*copy and checksum the payload in one pass. a corrupted copy only lands on free space of the buffer,
+   *it is never accounted, but data we keep out of order must not be overwritten before the check*/
+  fused = keep && !ooo_overlaps(socket, seq + skip, end);
+  if (fused) {
+    crc = update_crc32(crc, data, skip);
+    crc = ring_write_crc(socket, offset, data + skip, (uint32_t)(end - seq) - skip, crc);
+  } else {
+    crc = update_crc32(crc, data, recvmssg->header.data_len);
+  }
+  if ((crc ^ 0xffffffff) != checksum) return -1;
+
+  /*a pure ACK carries no data, its sequence number is no hole to keep or to SACK*/
+  if (recvmssg->header.data_len == 0) return 0;
+
+  /*nothing new or it does not fit, a sender that repeats data lost our ACK*/
+  if (!keep) return 1;
+
+  data += skip;
+  seq += skip;
+  if (!fused) ring_write(socket, offset, data, end - seq);
+
+  if (seq != socket->ack_number) {
+    /*there is a gap before it, keep it until the gap fills. the ACK is a dupACK, the sender needs it now*/
+    ooo_add(socket, seq, end);
+    return 1;
+  }
+  filled = socket->ooo_blocks > 0;
+
+  /*everything good, i got the correct package*/
+  socket->buf_fill_level += end - seq;
+  socket->ack_number = end;
+
+  /*deliver all the out-of-order blocks that are now in order*/
+  while (socket->ooo_blocks > 0 && SEQ_LEQ(socket->ooo[0].start, socket->ack_number)) {
+    if (SEQ_GT(socket->ooo[0].end, socket->ack_number)) {
+      socket->buf_fill_level += (uint32_t)(socket->ooo[0].end - socket->ack_number);
+      socket->ack_number = socket->ooo[0].end;
+    }
+    memmove(&socket->ooo[0], &socket->ooo[1], (socket->ooo_blocks - 1) * sizeof(socket->ooo[0]));
+    socket->ooo_blocks--;
+  }
+
+  /*the sender repairs the gap and waits for this ACK to leave recovery*/
+  return filled;
+}
+
+/*sends a cumulative ACK for the in-order data, followed by SACK blocks for the out-of-order data if the peer
+ *understands them*/
+static int
+send_ack (microtcp_sock_t *socket, message_t *sendmssg)
+{
+  int nblocks;
+
+  memset(&sendmssg->header, 0, sizeof(microtcp_header_t));
+  sendmssg->header.seq_number = socket->seq_number;
+  sendmssg->header.ack_number = socket->ack_number;
+  sendmssg->header.window = rcv_window(socket);
+  sendmssg->header.control = ACK;
+  socket->rcv_adv = sendmssg->header.window;
+  socket->rcv_acked = socket->ack_number;
+  timer_stop(socket, TIMER_DELACK);
+
+  if (socket->sack_permitted) {
+    nblocks = MIN(socket->ooo_blocks, MICROTCP_SACK_MAX_BLOCKS);
+    memcpy(sendmssg->data, socket->ooo, nblocks * sizeof(microtcp_ooo_block_t));
+    sendmssg->header.future_use0 = nblocks;
+  }
+
+  return send_segment(socket, sendmssg, 0);
+}
+
+/*ACKs the data that a batch brought in order. the ACK leaves at once if a segment of the batch asked for it or
+ *two full segments wait for it, otherwise the delayed ACK timer sends it unless more data comes first.
+ *a sender that starts or recovers from a loss has a small window and waits for every ACK, so the next few
+ *are never delayed*/
+static int
+ack_batch (microtcp_sock_t *socket, int ack_now)
+{
+  if (ack_now) socket->rcv_quickack = MICROTCP_QUICKACKS;
+  else if (socket->rcv_quickack > 0 && socket->ack_number != socket->rcv_acked) {
+    socket->rcv_quickack--;
+    ack_now = 1;
+  }
+
+  if (ack_now || (uint32_t)(socket->ack_number - socket->rcv_acked) >= 2 * MICROTCP_MSS) return send_ack(socket, &socket->pool->ctl);
+
+  if (socket->ack_number != socket->rcv_acked && !timer_armed(socket, TIMER_DELACK)) timer_set(socket, TIMER_DELACK, now_us() + MICROTCP_DELACK_US);
+  return 0;
+}
+
+/*the retransmission timer expired: backs off, then retransmits*/
+static int
+send_timeout (microtcp_sock_t *socket, int flags)
+{
+  if (socket->txq_head == NULL) return 0;
+
+  rto_backoff(socket);
+  timer_set(socket, TIMER_RTO, now_us() + socket->rto_us);
+
+  /*timeout*/
+  fprintf(stderr, "Receive timeout occurred\n");
+  socket->cc->on_timeout(socket);
+
+  return enter_recovery(socket, flags);
+}
+
+/*the persist timer expired: nothing is in flight and the receiver has no space, so a special package with 0
+ *payload asks for the window until the receiver opens it*/
+static int
+persist_timeout (microtcp_sock_t *socket)
+{
+  message_t *probe = &socket->pool->ctl;
+
+  /*the window opened, or data is in flight and the retransmission timer took over*/
+  if (socket->txq_head != NULL || socket->curr_win_size > 0) return 0;
+
+  rto_backoff(socket);
+  timer_set(socket, TIMER_PERSIST, now_us() + socket->rto_us);
+
+  memset(&probe->header, 0, sizeof(microtcp_header_t));
+  probe->header.ack_number = socket->ack_number;
+  probe->header.seq_number = socket->snd_una;
+  probe->header.control = ACK;
+
+  printf("Sending special package with 0 payload\n");
+  if (send_segment(socket, probe, 0) == -1)
   {
-    printf("Error in binding, closing the socket.\n");
+    printf("Error in sending the message to client\n");
+    fprintf(stderr, "Error: %s\n", strerror(errno));
     return -1;
   }
+  return 0;
+}
 
-  /*here we know the address of the server so we can initialize the global variable sr and the field on the server's socket*/
-  sr = address;
+/*runs the timers of the wheel that expired, the ones of this connection and of the others the wheel serves.
+ *the close timer has nothing to run, the close handshake sees that it is no longer armed, and the pacing
+ *timer only wakes the loop, which reports the socket writable again*/
+static int
+timers_run (microtcp_wheel_t *wheel)
+{
+  microtcp_timer_t *expired = NULL;
+  microtcp_timer_t *timer;
+  microtcp_sock_t *socket;
+  int ret = 0;
+
+  microtcp_wheel_expire(wheel, now_us(), &expired);
+  while ((timer = expired) != NULL) {
+    microtcp_timer_cancel(timer);
+    socket = timer->owner;
+    if (socket->state != ESTABLISHED) continue;
+
+    if (timer->kind == TIMER_RTO && send_timeout(socket, 0) == -1) ret = -1;
+    else if (timer->kind == TIMER_PERSIST && persist_timeout(socket) == -1) ret = -1;
+    else if (timer->kind == TIMER_DELACK && send_ack(socket, &socket->pool->ctl) == -1) ret = -1;
+  }
 
-  socket->state = LISTEN;
-  //socket->myaddr = address;
+  return ret;
+}
 
-  return 0; /*the binding was successful*/
+/*turns MSG_ZEROCOPY on the first time microtcp_send_zc() needs it. the connections of a listener share the UDP
+ *socket with the others and the ring sends on its own, they send the buffer in place without it*/
+static void
+zc_setup (microtcp_sock_t *socket)
+{
+  int one = 1;
+
+  if (socket->pool->zerocopy != 0) return;
+
+  if (socket->listener != NULL || socket_ring(socket) != NULL
+      || setsockopt(socket->sd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1)
+    socket->pool->zerocopy = -1;
+  else
+    socket->pool->zerocopy = 1;
 }
 
-int
-microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address,
-                  socklen_t address_len)
+/*takes the completions of the MSG_ZEROCOPY sends from the error queue of the UDP socket, without waiting*/
+static void
+zc_reap (microtcp_sock_t *socket)
 {
-  srand(time(NULL));   /*to create a random sequence number on each run*/
+  struct microtcp_pool *pool = socket->pool;
+  char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+  struct sock_extended_err *serr;
+  struct cmsghdr *cmsg;
+  struct msghdr msg;
+
+  while (pool->zc_done != pool->zc_sent) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(socket->sd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) return;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+          && !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) continue;
+
+      /*the completions of consecutive sends come merged, as a range of their numbers*/
+      serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+      if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+      pool->zc_done += serr->ee_data - serr->ee_info + 1;
+      /*the kernel had to copy the pages anyway, as on loopback, the buffer is sent in place without it*/
+      if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) pool->zerocopy = -1;
+    }
+  }
+}
 
-  socket->destaddr = address; /*here client knows server's adress which is its destination address*/
+/*waits until the kernel reports more zero-copy sends complete. returns the sends that are still not complete*/
+static uint32_t
+zc_wait (microtcp_sock_t *socket)
+{
+  struct pollfd pfd;
 
-  message_t *mssg = malloc(sizeof(message_t));
-  void *rcv = malloc(MICROTCP_RECVBUF_LEN);
+  zc_reap(socket);
+  if (socket->pool->zc_done == socket->pool->zc_sent) return 0;
 
-  memset(mssg, 0, sizeof(message_t));
-  
-  /*make message*/
-  mssg->header.seq_number = (uint32_t)(rand() % 10);
-  socket->seq_number = mssg->header.seq_number;
-  mssg->header.control = SYN;
-  mssg->header.window = MICROTCP_WIN_SIZE;
-  socket->init_win_size = MICROTCP_WIN_SIZE;
+  /*the error queue makes the socket report POLLERR*/
+  pfd.fd = socket->sd;
+  pfd.events = 0;
+  poll(&pfd, 1, socket->rto_us / 1000 + 1);
+  zc_reap(socket);
 
-  printf("Sending SYN, seq=%d, win=%d\n", mssg->header.seq_number, mssg->header.window);
+  return socket->pool->zc_sent - socket->pool->zc_done;
+}
 
-  if (sendto(socket->sd, (const void *)mssg, sizeof(message_t), 0, address, address_len) == -1)
-  {
-    printf("Error in sending the message from socket <%d>\n", socket->sd);
+/*bytes that microtcp_send() can put in flight now*/
+static size_t
+send_space (microtcp_sock_t *socket)
+{
+  size_t wnd = MIN(socket->curr_win_size, socket->cwnd);
+  size_t in_flight = (uint32_t)(socket->seq_number - socket->snd_una);
+
+  if (socket->pool == NULL || !seg_available(socket) || in_flight >= wnd || !pace_ready(socket)) return 0;
+  return wnd - in_flight;
+}
+
+/*processes both directions of the received batch, the ACKs for what we sent and the data for the receive
+ *buffer, which is ACKed once for the batch*/
+static int
+conn_segments (microtcp_sock_t *socket, int received, int flags)
+{
+  message_t *recvmssg;
+  int ack = 0;
+  int ret;
+
+  for (int i = 0; i < received; i++) {
+    recvmssg = batch_segment_unchecked(socket, i);
+
+    /*check for FIN ACK, nothing comes after it*/
+    if (recvmssg != NULL && recvmssg->header.control == (FIN|ACK) && recvmssg->header.checksum == segment_checksum(recvmssg)){
+      socket->bytes_received += MICROTCP_SEGMENT_LEN(recvmssg);
+      socket->packets_received++;
+      socket->state = CLOSING_BY_PEER;
+      if (process_ack(socket, recvmssg, flags) == -1) return -1;
+      break;
+    }
+
+    /*the checksum is verified while the payload is copied in the receive buffer*/
+    if (recvmssg == NULL || (ret = process_data(socket, recvmssg)) == -1) {
+      /*corrupted package, the ACK of the batch works as a dupACK for it*/
+      fprintf(stderr, "Wrong checksum, package corrupted\n");
+      ack = 1;
+      continue;
+    }
+
+    socket->bytes_received += MICROTCP_SEGMENT_LEN(recvmssg);
+    socket->packets_received++;
+    if (ret == 1) ack = 1;
+    /*a probe of the window we closed is answered once the application made space*/
+    else if (recvmssg->header.data_len == 0 && socket->rcv_adv == 0 && rcv_window(socket) > 0) ack = 1;
+
+    if (process_ack(socket, recvmssg, flags) == -1) return -1;
+  }
+
+  return ack_batch(socket, ack);
+}
+
+/*the input path of a non-blocking socket: takes the segments that are already here without waiting and
+ *processes them. returns the number of segments or -1 with errno set (EAGAIN if nothing was here)*/
+static int
+conn_input (microtcp_sock_t *socket, int flags)
+{
+  int received;
+
+  /*the completions of the zero-copy sends make the UDP socket readable for the loop too*/
+  if (socket->pool->zc_done != socket->pool->zc_sent) zc_reap(socket);
+
+  received = recv_batch(socket, flags | MSG_DONTWAIT);
+  if (received == -1 || conn_segments(socket, received, flags) == -1) return -1;
+
+  return received;
+}
+
+/*microtcp_send() of a non-blocking socket: queues what fits in the window and returns, the segments in flight
+ *are ACKed and retransmitted by later calls and by microtcp_poll()*/
+static ssize_t
+send_nonblock (microtcp_sock_t *socket, iov_cursor_t *src, size_t length, int zerocopy, int flags)
+{
+  tx_batch_t batch;
+  size_t queued = 0;
+  size_t space;
+  size_t len;
+
+  /*the ACKs that are already here open the window*/
+  while (conn_input(socket, flags) != -1);
+  if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+
+  if (timers_run(socket->pool->timers) == -1) return -1;
+
+  batch.count = 0;
+  batch.zerocopy = 0;
+  while (queued < length && (space = send_space(socket)) > 0) {
+    len = min3(MICROTCP_MSS, length - queued, space);
+    if (txq_push(socket, &batch, src, len, zerocopy, flags) == -1) return -1;
+    queued += len;
+  }
+  if (batch_flush(socket, &batch, flags) == -1) return -1;
+
+  /*the pacing held the rest back, the loop waits for it*/
+  if (queued < length && !pace_ready(socket)) timer_set(socket, TIMER_PACE, socket->pace_next_us);
+
+  if (queued < length) {
+    /*with nothing in flight only the persist timer finds out when the window opens*/
+    if (socket->txq_head == NULL && !timer_armed(socket, TIMER_PERSIST)) timer_set(socket, TIMER_PERSIST, now_us() + socket->rto_us);
+    socket->persist = 1;
+  } else {
+    timer_stop(socket, TIMER_PERSIST);
+    socket->persist = 0;
+  }
+
+  if (queued == 0 && length > 0) {
+    errno = EAGAIN;
     return -1;
   }
 
-  printf("MESSAGE SENT\n");
+  return queued;
+}
 
-  if (recvfrom(socket->sd, (void *restrict)rcv, sizeof(message_t), 0, (struct sockaddr *restrict)address, (socklen_t *restrict)&address_len) == -1)
-  {
-    printf("Error in receiving the message in socket <%d>\n", socket->sd);
+/*pipelined sender: keeps the window full of segments and slides it forward as the cumulative ACKs arrive.
+ *the segments are cut from the iovecs one after the other, regardless of where each of them ends.
+ *returns when every byte is ACKed, and with zerocopy when the kernel released the pages too*/
+static ssize_t
+send_data (microtcp_sock_t *socket, const struct iovec *iov, int iovcnt, int zerocopy, int flags)
+{
+  tx_batch_t batch;
+  iov_cursor_t src = { iov, iovcnt, 0 };
+  size_t length = 0;
+  size_t queued = 0;  /*bytes of the buffer that are already in the retransmission queue*/
+  size_t wnd;
+  size_t in_flight;
+  size_t len;
+  size_t una;
+  uint64_t give_up;
+  int received;
+
+  /*not connected*/
+  if (socket->pool == NULL) return -1;
+
+  for (int i = 0; i < iovcnt; i++) length += iov[i].iov_len;
+  if (iovcnt < 0 || length > SSIZE_MAX) {
+    errno = EINVAL;
     return -1;
   }
 
-  memcpy(mssg, rcv, sizeof(message_t));
+  if (socket->nonblock) return send_nonblock(socket, &src, length, zerocopy, flags);
+
+  batch.count = 0;
+  batch.zerocopy = 0;
+  una = socket->snd_una;
+  give_up = socket->user_timeout_us ? now_us() + socket->user_timeout_us : 0;
+  while(queued < length || socket->txq_head != NULL){
+
+    /*fill the window with new segments, they leave together with one sendmmsg. the pool bounds the flight too*/
+    wnd = MIN(socket->curr_win_size, socket->cwnd);
+    in_flight = (uint32_t)(socket->seq_number - socket->snd_una);
+    while(queued < length && in_flight < wnd && seg_available(socket) && pace_ready(socket)){
+      len = min3(MICROTCP_MSS, length - queued, wnd - in_flight);
+      if (txq_push(socket, &batch, &src, len, zerocopy, flags) == -1) return -1;
+      queued += len;
+      in_flight += len;
+    }
+    if (batch_flush(socket, &batch, flags) == -1) return -1;
 
-  printf("Received ??, seq=%d, ack=%d\n", mssg->header.seq_number, mssg->header.ack_number);
+    /*nothing in flight means the window is closed, the persist timer probes it until it opens*/
+    if (socket->txq_head == NULL && !timer_armed(socket, TIMER_PERSIST)) timer_set(socket, TIMER_PERSIST, now_us() + socket->rto_us);
 
-  if (mssg->header.control != (SYN | ACK)) return -1;
+    if (queued < length && in_flight < wnd && seg_available(socket)) {
+      /*the pacing holds the next segment back, the ACKs that arrive meanwhile wait in the UDP socket*/
+      pace_sleep(socket);
+      received = recv_batch(socket, MSG_DONTWAIT);
+    } else {
+      /*wait for the next ACKs until a timer expires*/
+      set_recv_timeout(socket, user_wait_us(timers_wait_us(socket), give_up));
+      received = recv_batch(socket, 0);
+    }
+    if (received == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        printf("Error in receiving the message in socket <%d>\n", socket->sd);
+        fprintf(stderr, "Error: %s\n", strerror(errno));
+        return -1;
+      }
+    }
+    /*the peer may send too, its data goes in the receive buffer for the next microtcp_recv()*/
+    if (received > 0 && conn_segments(socket, received, flags) == -1) return -1;
+    if (socket->pool->zc_done != socket->pool->zc_sent) zc_reap(socket);
+
+    if (timers_run(socket->pool->timers) == -1) return -1;
+
+    /*the user timeout counts from the last time the peer ACKed new data*/
+    if (socket->snd_una != una) {
+      una = socket->snd_una;
+      if (give_up != 0) give_up = now_us() + socket->user_timeout_us;
+    } else if (give_up != 0 && now_us() >= give_up) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+  }
 
-  printf("Received SYN ACK with win=%d\n", mssg->header.window);
+  while (zerocopy && zc_wait(socket) > 0);
 
-  socket->curr_win_size = mssg->header.window; /*fixing curr_win_size of client according to what the server sent to him*/
+  return length;
+}
+
+ssize_t
+microtcp_send (microtcp_sock_t *socket, const void *buffer, size_t length,
+               int flags)
+{
+  struct iovec iov = { (void *)buffer, length };
+
+  return send_data(socket, &iov, 1, 0, flags);
+}
+
+ssize_t
+microtcp_sendmsg (microtcp_sock_t *socket, const struct iovec *iov, int iovcnt, int flags)
+{
+  return send_data(socket, iov, iovcnt, 0, flags);
+}
+
+ssize_t
+microtcp_send_zc (microtcp_sock_t *socket, const void *buffer, size_t length, int flags)
+{
+  struct iovec iov = { (void *)buffer, length };
+
+  /*not connected*/
+  if (socket->pool == NULL) return -1;
+
+  zc_setup(socket);
+  return send_data(socket, &iov, 1, 1, flags);
+}
+
+int
+microtcp_send_zc_pending (microtcp_sock_t *socket)
+{
+  if (socket->pool == NULL) return 0;
+
+  zc_reap(socket);
+  return socket->pool->zc_queued > 0 || socket->pool->zc_done != socket->pool->zc_sent;
+}
+
+/*sendfile without a mapping: the file is read in windows of this many bytes*/
+#define SENDFILE_WINDOW (4 << 20)
+
+ssize_t
+microtcp_sendfile (microtcp_sock_t *socket, int fd, off_t offset, size_t count)
+{
+  struct stat st;
+  struct iovec iov;
+  uint8_t *map;
+  size_t skip;
+  size_t sent = 0;
+  ssize_t n;
+
+  /*not connected*/
+  if (socket->pool == NULL) return -1;
+
+  if (offset < 0 || fstat(fd, &st) == -1) {
+    if (offset < 0) errno = EINVAL;
+    return -1;
+  }
+
+  /*as sendfile() stops at the end of the file*/
+  if (S_ISREG(st.st_mode)) {
+    if (offset >= st.st_size) return 0;
+    count = MIN(count, (size_t)(st.st_size - offset));
+  }
+  if (count == 0) return 0;
+
+  /*the segments are copied straight from the page cache and the whole range is one send, so the window stays
+   *full from the first byte of the file to the last*/
+  skip = offset & (sysconf(_SC_PAGESIZE) - 1);
+  map = S_ISREG(st.st_mode) ? mmap(NULL, skip + count, PROT_READ, MAP_SHARED, fd, offset - skip) : MAP_FAILED;
+  if (map != MAP_FAILED) {
+    madvise(map, skip + count, MADV_SEQUENTIAL);
+    iov.iov_base = map + skip;
+    iov.iov_len = count;
+    n = send_data(socket, &iov, 1, 0, 0);
+    munmap(map, skip + count);
+    return n;
+  }
+
+  /*pipes and the like: large reads and a send for each*/
+  iov.iov_base = malloc(MIN(count, SENDFILE_WINDOW));
+  if (iov.iov_base == NULL) return -1;
+  while (sent < count) {
+    n = pread(fd, iov.iov_base, MIN(count - sent, SENDFILE_WINDOW), offset + sent);
+    if (n == -1 && errno == ESPIPE) n = read(fd, iov.iov_base, MIN(count - sent, SENDFILE_WINDOW));
+    if (n <= 0) break;
+    iov.iov_len = n;
+    n = send_data(socket, &iov, 1, 0, 0);
+    if (n <= 0) break;
+    sent += n;
+    if (n < (ssize_t)iov.iov_len) break;
+  }
+  free(iov.iov_base);
+
+  return sent > 0 || n == 0 ? (ssize_t)sent : -1;
+}
+
+/*where recv_data hands over the data: the iovecs of the application, or a file if fd is not -1*/
+typedef struct
+{
+  const struct iovec *iov;
+  int iovcnt;
+  int fd;
+  off_t offset;                           /*where the next byte goes in the file*/
+  size_t len;                             /*the most bytes the file still takes*/
+  int error;                              /*errno of a write that failed after a part of the data was written*/
+} recv_dest_t;
+
+/*writes the data of the receive buffer in the file straight from the ring, both of its pieces with one call.
+ *a write that fails after some of the data is in the file leaves its errno in dest->error*/
+static ssize_t
+recv_write (microtcp_sock_t *socket, recv_dest_t *dest)
+{
+  struct iovec iov[2];
+  size_t len = MIN(socket->buf_fill_level, dest->len);
+  size_t first;
+  ssize_t written;
+
+  for (size_t done = 0; done < len; done += written) {
+    first = MIN(len - done, socket->recvbuf_len - socket->recvbuf_head);
+    iov[0].iov_base = socket->recvbuf + socket->recvbuf_head;
+    iov[0].iov_len = first;
+    iov[1].iov_base = socket->recvbuf;
+    iov[1].iov_len = len - done - first;
+    written = pwritev(dest->fd, iov, iov[1].iov_len > 0 ? 2 : 1, dest->offset);
+    if (written == -1 && errno == EINTR) {
+      written = 0;
+      continue;
+    }
+    if (written <= 0) {
+      if (written == 0) errno = EIO;
+      if (done == 0) return -1;
+      dest->error = errno;
+      return done;
+    }
+    socket->recvbuf_head = (socket->recvbuf_head + written) & (socket->recvbuf_len - 1);
+    socket->buf_fill_level -= written;
+    dest->offset += written;
+    dest->len -= written;
+  }
+
+  return len;
+}
+
+/*hands over the data of the receive buffer to the user, straight from the ring into each iovec in turn or in
+ *the file. the head of the ring moves past it*/
+static ssize_t
+recv_deliver (microtcp_sock_t *socket, recv_dest_t *dest)
+{
+  ssize_t bytes_delivered = 0;
+  size_t len;
+
+  if (dest->fd != -1) {
+    bytes_delivered = recv_write(socket, dest);
+  } else {
+    for (int i = 0; i < dest->iovcnt && socket->buf_fill_level > 0; i++) {
+      len = MIN(dest->iov[i].iov_len, socket->buf_fill_level);
+      ring_read(socket, dest->iov[i].iov_base, len);
+      socket->recvbuf_head = (socket->recvbuf_head + len) & (socket->recvbuf_len - 1);
+      socket->buf_fill_level -= len;
+      bytes_delivered += len;
+    }
+  }
+  if (bytes_delivered > 0) recvbuf_autotune(socket, bytes_delivered);
 
-  /*making next message*/
-  mssg->header.ack_number = mssg->header.seq_number + 1;
-  socket->ack_number = mssg->header.ack_number;
-  mssg->header.seq_number = socket->seq_number + 1;
-  socket->seq_number = socket->seq_number + 1;
-  mssg->header.window = MICROTCP_WIN_SIZE;
-  mssg->header.control = mssg->header.control & (~(SYN)); /*we are "subtracting" the SYN flag*/
+  return bytes_delivered;
+}
 
-  printf("Sending ACK, seq=%d, ack=%d\n", mssg->header.seq_number, mssg->header.ack_number);
-  if (sendto(socket->sd, mssg, sizeof(message_t), 0, address, address_len) == -1)
-  {
-    printf("Error in sending the message from socket <%d>\n", socket->sd);
+/*receives until there is something in the receive buffer and hands over as much of it as dest takes*/
+static ssize_t
+recv_data (microtcp_sock_t *socket, recv_dest_t *dest, int flags)
+{
+  message_t *sendmssg;
+  ssize_t bytes_delivered;
+  uint64_t idle_deadline, give_up, now, wait;
+  int received;
+  int ack;
+
+  /*not connected*/
+  if (socket->pool == NULL) return -1;
+  sendmssg = &socket->pool->ctl;
+
+  /*a delayed ACK may be due*/
+  if (timers_run(socket->pool->timers) == -1) return -1;
+
+  /*the FIN came after the data that is still in the buffer, the user gets the data first*/
+  if (socket->state == CLOSING_BY_PEER && socket->buf_fill_level == 0) {
+    errno = ENOTCONN;
     return -1;
   }
 
-  socket->state = ESTABLISHED;
+  if (socket->nonblock) {
+    /*take what is already here and hand it over, without waiting for more*/
+    while (socket->buf_fill_level == 0 && socket->state != CLOSING_BY_PEER) {
+      if (conn_input(socket, flags) == -1) return -1;
+    }
+    if (socket->buf_fill_level == 0) {
+      errno = ENOTCONN;
+      return -1;
+    }
+    bytes_delivered = recv_deliver(socket, dest);
 
-  /*allocate memory for recvbuf and initialize the window values accordingly*/
-  socket->recvbuf = malloc(MICROTCP_RECVBUF_LEN);
-  socket->cwnd = MICROTCP_INIT_CWND;
-  socket->ssthresh = MICROTCP_INIT_SSTHRESH;
+    /*nobody waits in recv to ACK the next segments, so the sender learns here that the closed window opened*/
+    if (socket->rcv_adv == 0 && rcv_window(socket) > 0 && socket->state == ESTABLISHED && send_ack(socket, sendmssg) == -1) return -1;
+    return bytes_delivered;
+  }
 
-  return 0; /*the connection was successful*/
-}
+  /*if nothing arrives for an RTO we send a dupACK, backing off while the sender stays silent*/
+  uint64_t idle_timeout = socket->rto_us;
+  idle_deadline = now_us() + idle_timeout;
+  give_up = socket->user_timeout_us ? now_us() + socket->user_timeout_us : 0;
 
-int
-microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address,
-                 socklen_t address_len)
-{
-  srand(time(NULL));
+  /*receive messages until there is something in the buffer to hand over to the user*/
+  while(socket->buf_fill_level == 0){
 
-  message_t *mssg = malloc(sizeof(message_t));
-  void *rcv = malloc(MICROTCP_RECVBUF_LEN);
-  memset(rcv, 0, sizeof(*rcv));
+    /*wait until the idle timeout, or a timer of the connection that expires before it*/
+    now = now_us();
+    wait = timers_wait_us(socket);
+    if (wait == 0 || now + wait > idle_deadline) wait = idle_deadline > now ? idle_deadline - now : 1;
+    set_recv_timeout(socket, user_wait_us(wait, give_up));
+
+    ack = 0;
+    received = recv_batch(socket, flags);
+    if (received == -1)
+    {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        printf("Error in receiving the message in socket <%d>\n", socket->sd);
+        fprintf(stderr, "Error: %s\n", strerror(errno));
+        return -1;
+      }
+      if (give_up != 0 && now_us() >= give_up) {
+        /*the peer stayed silent for the whole user timeout*/
+        errno = EAGAIN;
+        return -1;
+      }
+      if (now_us() >= idle_deadline) {
+        /*timeout, the ACK of everything we have in order so far is a dupACK*/
+        fprintf(stderr, "Receive timeout occurred\n");
+        printf("Sending dupACK, ack=%d\n", (uint32_t)socket->ack_number);
+        ack = 1;
+        idle_timeout = MIN(2 * idle_timeout, MICROTCP_MAX_RTO_US);
+        idle_deadline = now_us() + idle_timeout;
+      }
+    }
 
-  memset(mssg, 0, sizeof(*mssg));
+    if (received > 0 && give_up != 0) give_up = now_us() + socket->user_timeout_us;
 
-  cl = address; /*here the server knows the address of the client, so we can initialize the global variable cl*/
-  socket->destaddr = address; /*which is also its destinaton address*/
+    /*the segments may ACK what we sent too, both directions are processed and the data is ACKed once for the batch*/
+    if (received > 0 && conn_segments(socket, received, flags) == -1)
+    {
+      printf("Error in sending the message to client\n");
+      fprintf(stderr, "Error: %s\n", strerror(errno));
+      return -1;
+    }
 
-  printf("WAITING TO ACCEPT\n");
+    if (socket->state == CLOSING_BY_PEER && socket->buf_fill_level == 0) {
+      /*call shutdown*/
+      errno = ENOTCONN;
+      return -1;
+    }
 
-  if (recvfrom(socket->sd, (void *restrict)rcv, sizeof(message_t), 0, (struct sockaddr *restrict)address, (socklen_t *restrict)&address_len) == -1)
-  {
-    printf("Error in receiving the message in socket <%d>\n", socket->sd);
-    fprintf(stderr, "Error: %s\n", strerror(errno));
-    return -1;
+    /*after a timeout the ACK of everything we have in order so far is a dupACK*/
+    if ((ack && ack_batch(socket, ack) == -1) || timers_run(socket->pool->timers) == -1)
+    {
+      printf("Error in sending the message to client\n");
+      fprintf(stderr, "Error: %s\n", strerror(errno));
+      return -1;
+    }
   }
 
-  printf("MESSAGE RECEIVED\n");
+  return recv_deliver(socket, dest);
+}
+
+ssize_t
+microtcp_recv (microtcp_sock_t *socket, void *buffer, size_t length, int flags)
+{
+  struct iovec iov = { buffer, length };
+  recv_dest_t dest = { &iov, 1, -1, 0, 0, 0 };
 
-  memcpy(mssg, rcv, sizeof(message_t));
+  return recv_data(socket, &dest, flags);
+}
 
-  printf("Received ??, seq=%d, win=%d\n", mssg->header.seq_number, mssg->header.window);
+ssize_t
+microtcp_recvmsg (microtcp_sock_t *socket, const struct iovec *iov, int iovcnt, int flags)
+{
+  recv_dest_t dest = { iov, iovcnt, -1, 0, 0, 0 };
 
-  if (mssg->header.control != (SYN)) {
-    printf("SYN: %d\nWe got: %d\n", SYN, mssg->header.window);  
+  if (iovcnt < 0) {
+    errno = EINVAL;
     return -1;
   }
 
-  printf("Received SYN with win=%d\n", mssg->header.window);
+  return recv_data(socket, &dest, flags);
+}
 
-  /*make message*/
-  mssg->header.ack_number = mssg->header.seq_number + 1;
-  socket->ack_number = mssg->header.ack_number;
-  mssg->header.seq_number = (uint32_t)(rand() % 10);
-  socket->seq_number = mssg->header.seq_number;
-  mssg->header.control = mssg->header.control | ACK; /*making the SYN ACK flag only with the |ACK because the header has already the SYN in it*/
-  mssg->header.window = MICROTCP_WIN_SIZE;
-  socket->init_win_size = mssg->header.window;
+ssize_t
+microtcp_recvfile (microtcp_sock_t *socket, int fd, off_t offset, size_t count, int flags)
+{
+  recv_dest_t dest = { NULL, 0, fd, offset, count, 0 };
+  size_t total = 0;
+  ssize_t n;
 
-  printf("Sending SYN ACK, seq=%d, ack=%d, win=%d\n", mssg->header.seq_number, mssg->header.ack_number, mssg->header.window);
-  if (sendto(socket->sd, mssg, sizeof(message_t), 0, address, address_len) == -1)
-  {
-    printf("Error in sending the message from socket <%d>\n", socket->sd);
-    fprintf(stderr, "Error: %s\n", strerror(errno));
+  if (fd == -1 || offset < 0) {
+    errno = EINVAL;
     return -1;
   }
 
-  if (recvfrom(socket->sd, (void *restrict)rcv, sizeof(message_t), 0, (struct sockaddr *restrict)address, (socklen_t *restrict)&address_len) == -1)
-  {
-    printf("Error in receiving the message in socket <%d>\n", socket->sd);
-    return -1;
+  while (total < count) {
+    n = recv_data(socket, &dest, flags);
+    if (n == -1) {
+      /*only the FIN of the peer ends the file, a failed write or a non-blocking socket with nothing here are errors*/
+      if (errno == ENOTCONN && socket->state == CLOSING_BY_PEER) break;
+      return -1;
+    }
+    if (dest.error) {
+      errno = dest.error;
+      return -1;
+    }
+    total += n;
+    if (socket->nonblock) break;
   }
 
-  memcpy(mssg, rcv, sizeof(message_t));
-  printf("Received ??, seq=%d, ack=%d\n", mssg->header.seq_number, mssg->header.ack_number);
+  return total;
+}
 
-  if (mssg->header.control != (ACK)) return -1;
-  
-  printf("Received ACK\n");
+/*receives the next segment of a step of the close handshake. the peer may be busy with its other connections,
+ *so each step waits for it until the close timer expires*/
+static ssize_t
+close_recv (microtcp_sock_t *socket, message_t *mssg, struct sockaddr *address, socklen_t *address_len)
+{
+  ssize_t ret;
 
-  socket->state = ESTABLISHED;
+  for (;;) {
+    if (!timer_armed(socket, TIMER_CLOSE)) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
 
-  /*allocate memory for recvbuf and initialize the window values accordingly*/
-  socket->recvbuf = malloc(MICROTCP_RECVBUF_LEN);
-  socket->curr_win_size = mssg->header.window;
-  socket->cwnd = MICROTCP_INIT_CWND;
-  socket->ssthresh = MICROTCP_INIT_SSTHRESH;
+    set_recv_timeout(socket, timers_wait_us(socket));
+    ret = recv_segment(socket, mssg, 0, address, address_len);
+    if (ret > 0 && !(mssg->header.control & (SYN | FIN))) {
+      /*the peer repeats data whose ACK was lost, without an ACK its send never returns*/
+      if (process_data(socket, mssg) != -1 && send_ack(socket, mssg) == -1) return -1;
+      continue;
+    }
+    if (ret != -1 || (errno != EAGAIN && errno != EWOULDBLOCK)) return ret;
 
-  return 0; /*successful acceptance*/
+    timers_run(socket->pool->timers);
+  }
 }
 
 int
 microtcp_shutdown (microtcp_sock_t *socket, int how)
 {
+  /*address and addrlen are variables to use in recvfrom so that the socket's addresses won't change*/
+  struct sockaddr_storage address;
+  socklen_t addrlen = sizeof(address);
+
+  /*a listener only has its backlog to free, its connections are closed by then*/
+  if (socket->state == LISTEN && socket->listener != NULL) {
+    if (socket->listener->rx.ring != NULL) rxbatch_ring_stop(&socket->listener->rx);
+    free(socket->listener->rx.arena);
+    free(socket->listener->backlog);
+    free(socket->listener);
+    socket->listener = NULL;
+    socket->state = CLOSED;
+    return 0;
+  }
+
+  if (socket->pool == NULL && pool_init(socket) == -1) return -1;
 
   /*if the server receives a FIN ACK in microtcp_recv the server's state changes to "CLOSING BY PEER" and then we continue to shutdown*/
   if(socket->state == CLOSING_BY_PEER){
 
-    message_t *server_mssg = malloc(sizeof(message_t));
-    void *server_rcv = malloc(MICROTCP_RECVBUF_LEN);
-    /*address and addrlen are variables to use in recvfrom so that the socket's addresses won't change*/
-    struct sockaddr *address = malloc(sizeof(struct sockaddr));
-    socklen_t addrlen = sizeof(struct sockaddr_in);
-
-    memset(address, 0, sizeof(struct sockaddr));
+    message_t *server_mssg = &socket->pool->ctl;
 
     memset(server_mssg, 0, sizeof(*server_mssg));
-    memset(server_rcv, 0, sizeof(*server_rcv));
 
-    server_mssg->header.ack_number = socket->seq_number + 1;
+    /*the FIN takes the sequence number after the data*/
+    server_mssg->header.ack_number = socket->ack_number + 1;
     socket->ack_number = server_mssg->header.ack_number;
     server_mssg->header.control = ACK;
 
     printf("Sending ACK, ack=%d\n", server_mssg->header.ack_number);
-    if (sendto(socket->sd, server_mssg, sizeof(message_t), 0, socket->destaddr, cl_len) == -1)
+    if (send_segment(socket, server_mssg, 0) == -1)
     {
       printf("Error in sending the message to client\n");
       fprintf(stderr, "Error: %s\n", strerror(errno));
@@ -263,23 +2812,21 @@ microtcp_shutdown (microtcp_sock_t *socket, int how)
     server_mssg->header.control = (FIN | ACK);
 
     printf("Sending FIN ACK, seq=%d, ack=%d\n", server_mssg->header.seq_number, server_mssg->header.ack_number);
-    if (sendto(socket->sd, server_mssg, sizeof(message_t), 0, socket->destaddr, cl_len) == -1)
+    if (send_segment(socket, server_mssg, 0) == -1)
     {
       printf("Error in sending the message to client\n");
       fprintf(stderr, "Error: %s\n", strerror(errno));
       return -1;
     }
 
-
-    if (recvfrom(socket->sd, (void *restrict)server_rcv, MICROTCP_RECVBUF_LEN, 0, (struct sockaddr *restrict)address, (socklen_t *restrict)&addrlen) == -1)
+    timer_set(socket, TIMER_CLOSE, now_us() + CLOSE_TIMEOUT_US);
+    if (close_recv(socket, server_mssg, (struct sockaddr *)&address, &addrlen) == -1)
     {
       printf("Error in receiving the message from client\n");
       fprintf(stderr, "Error: %s\n", strerror(errno));
       return -1;
     }
 
-    memcpy(server_mssg, server_rcv, sizeof(message_t));
-
     printf("Received ??, seq=%d, ack=%d\n", server_mssg->header.seq_number, server_mssg->header.ack_number);
 
     if (server_mssg->header.control != (ACK)) return -1;
@@ -289,44 +2836,57 @@ microtcp_shutdown (microtcp_sock_t *socket, int how)
     socket->ack_number = server_mssg->header.ack_number;
 
     socket->state = CLOSED;
+    pool_free(socket);
     
     printf("Server's state changed to CLOSED\n");
   } 
   else   /*client calls shutdown when he wants to terminate the connection*/
   {
-    message_t *client_mssg = malloc(sizeof(message_t));
-    void *client_rcv = malloc(MICROTCP_RECVBUF_LEN);
-    /*address and addrlen are variables to use in recvfrom so that the socket's addresses won't change*/
-    struct sockaddr *address = malloc(sizeof(struct sockaddr));
-    socklen_t addrlen = sizeof(struct sockaddr_in);
-
-    memset(address, 0, sizeof(struct sockaddr));
+    message_t *client_mssg = &socket->pool->ctl;
+    uint8_t nonblock = socket->nonblock;
+
+    /*the data a non-blocking send left in flight is ACKed before the FIN, as a blocking send would have waited*/
+    if (socket->txq_head != NULL) {
+      socket->nonblock = 0;
+      if (microtcp_send(socket, NULL, 0, 0) == -1) {
+        socket->nonblock = nonblock;
+        return -1;
+      }
+      socket->nonblock = nonblock;
+    }
+    /*the ACKs that are still here must not be taken for the ACK of our FIN*/
+    if (socket->nonblock) {
+      while (conn_input(socket, 0) != -1);
+    }
 
     memset(client_mssg, 0, sizeof(*client_mssg));
-    memset(client_rcv, 0, sizeof(*client_rcv));
 
     client_mssg->header.control = (FIN | ACK);
     client_mssg->header.seq_number = socket->seq_number;
+    /*the FIN ACKs what we received too, the peer may still wait for that ACK*/
+    client_mssg->header.ack_number = socket->ack_number;
+    client_mssg->header.window = rcv_window(socket);
 
     printf("Sending FIN ACK, seq=%d\n", client_mssg->header.seq_number);
-    if (sendto(socket->sd, client_mssg, sizeof(message_t), 0, socket->destaddr, sr_len) == -1)
+    if (send_segment(socket, client_mssg, 0) == -1)
     {
       printf("Error in sending the message to server\n");
       fprintf(stderr, "Error: %s\n", strerror(errno));
       return -1;
     }
 
+    /*late ACKs of our data may still arrive, only the ACK of the FIN counts*/
+    timer_set(socket, TIMER_CLOSE, now_us() + CLOSE_TIMEOUT_US);
+    do {
+      if (close_recv(socket, client_mssg, (struct sockaddr *)&address, &addrlen) == -1)
+      {
+        printf("Error in receiving the message from server\n");
+        fprintf(stderr, "Error: %s\n", strerror(errno));
+        return -1;
+      }
 
-    if (recvfrom(socket->sd, (void *restrict)client_rcv, MICROTCP_RECVBUF_LEN, 0, (struct sockaddr *restrict)address, (socklen_t *restrict)&addrlen) == -1)
-    {
-      printf("Error in receiving the message from server\n");
-      fprintf(stderr, "Error: %s\n", strerror(errno));
-      return -1;
-    }
-
-    memcpy(client_mssg, client_rcv, sizeof(message_t));
-
-    printf("Received ??, seq=%d, ack=%d\n", client_mssg->header.seq_number, client_mssg->header.ack_number);
+      printf("Received ??, seq=%d, ack=%d\n", client_mssg->header.seq_number, client_mssg->header.ack_number);
+    } while (client_mssg->header.control == ACK && client_mssg->header.ack_number != (uint32_t)(socket->seq_number + 1));
 
     if (client_mssg->header.control != (ACK)) return -1;
 
@@ -340,16 +2900,17 @@ microtcp_shutdown (microtcp_sock_t *socket, int how)
 
     printf("Client's state changed to CLOSING_BY_HOST\n");
 
-    if (recvfrom(socket->sd, (void *restrict)client_rcv, MICROTCP_RECVBUF_LEN, 0, (struct sockaddr *restrict)address, (socklen_t *restrict)&addrlen) == -1)
-    {
-      printf("Error in receiving the message from server\n");
-      fprintf(stderr, "Error: %s\n", strerror(errno));
-      return -1;
-    }
-
-    memcpy(client_mssg, client_rcv, sizeof(message_t));
+    timer_set(socket, TIMER_CLOSE, now_us() + CLOSE_TIMEOUT_US);
+    do {
+      if (close_recv(socket, client_mssg, (struct sockaddr *)&address, &addrlen) == -1)
+      {
+        printf("Error in receiving the message from server\n");
+        fprintf(stderr, "Error: %s\n", strerror(errno));
+        return -1;
+      }
 
-    printf("Received ??, seq=%d, ack=%d\n", client_mssg->header.seq_number, client_mssg->header.ack_number);
+      printf("Received ??, seq=%d, ack=%d\n", client_mssg->header.seq_number, client_mssg->header.ack_number);
+    } while (client_mssg->header.control == ACK);
 
     if (client_mssg->header.control != (FIN | ACK)) return -1;
     printf("Received FIN ACK\n");
@@ -359,7 +2920,7 @@ microtcp_shutdown (microtcp_sock_t *socket, int how)
     client_mssg->header.control = client_mssg->header.control & (~(FIN)); /*we are "subtracting" the FIN flag to send only an ACK*/
 
     printf("Sending ACK, seq=%d, ack=%d\n", client_mssg->header.seq_number, client_mssg->header.ack_number);
-    if (sendto(socket->sd, client_mssg, sizeof(message_t), 0, socket->destaddr, sr_len) == -1)
+    if (send_segment(socket, client_mssg, 0) == -1)
     {
       printf("Error in sending the message to server\n");
       fprintf(stderr, "Error: %s\n", strerror(errno));
@@ -367,6 +2928,7 @@ microtcp_shutdown (microtcp_sock_t *socket, int how)
     }
 
     socket->state = CLOSED;
+    pool_free(socket);
 
     printf("Client's state changed to CLOSED\n");
 
@@ -376,468 +2938,329 @@ microtcp_shutdown (microtcp_sock_t *socket, int how)
 
 }
 
+int
+microtcp_set_recvbuf (microtcp_sock_t *socket, size_t len, int autotune)
+{
+  size_t pow2 = MICROTCP_RECVBUF_LEN;
 
-/*retransmition logic: Prepei na 3anasteiloume ta paketa apo to last ACKed paketo kai meta apo to ka8e batch dedomenwn ths while loop
- *Gia na to kanoume auto 3anastelnoume ta paketa kai meta peirazoume to i ths for pou xrhsimopoioume gia na lavoume ta ACKs katallhla wste sthn epomenh epanalhpsh tou
- *na perimenei pali gia to swsto ACK*/
-ssize_t
-microtcp_send (microtcp_sock_t *socket, const void *buffer, size_t length,
-               int flags)
+  if (socket->state == ESTABLISHED || len > MICROTCP_RECVBUF_MAX) return -1;
+
+  while (pow2 < len) pow2 <<= 1;
+  socket->recvbuf_len = pow2;
+  socket->recvbuf_autotune = autotune != 0;
+
+  return 0;
+}
+
+int
+microtcp_set_offload (microtcp_sock_t *socket, int enable)
 {
-  socklen_t dest_len = sizeof(struct sockaddr);
-  message_t sendmssg;
-  size_t remaining;
-  uint32_t checksum;
-  int bytes_sent;
-  int total_bytes_sent=0;
-  size_t bytes_to_send;
-  size_t data_sent;
-  int chunks;
-  void *data_per_chunk = malloc(length);
-  void *temp = malloc(length);
-  /*used for getting the acks*/
-  int dupACKs=0;
-  struct sockaddr *src_address = malloc(sizeof(struct sockaddr));
-  socklen_t src_len = sizeof(struct sockaddr);
-  int bytes_received;
-  message_t recvmssg;
-  size_t *chunk_seq_number;
-  size_t *bytes_per_chunk;
-  size_t prev_ack;
-  
-  /*initializations*/
-  memset(&sendmssg, 0, sizeof(sendmssg));
-  memset(&checksum, 0, sizeof(checksum));
-  memset(data_per_chunk, 0, sizeof(data_per_chunk));
-  memset(temp, 0, sizeof(temp));
-  memset(&bytes_to_send, 0, sizeof(bytes_to_send));
-  memset(&data_sent, 0, sizeof(data_sent));
-  memset(&recvmssg, 0, sizeof(recvmssg));
-  prev_ack = socket->ack_number;
-
-  memcpy(temp, buffer, length);
-
-  /*set the receive timeout time with the code given*/
-  struct timeval timeout;
-  timeout. tv_sec = 0;
-  timeout. tv_usec =MICROTCP_ACK_TIMEOUT_US; 
-  if (setsockopt(socket->sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( struct timeval)) < 0) {
-    perror(" setsockopt");
-  }
+  socket->gso = enable != 0;
+  socket->gro = enable != 0;
+  if (socket->state != ESTABLISHED) return 0;
 
-  /*devide into chunks and send*/
+  offload_setup(socket);
 
-  remaining = length;
-  while(data_sent < length){
-    
-    bytes_to_send = min3(socket->curr_win_size, socket->cwnd, remaining);
-    chunks = bytes_to_send/MICROTCP_MSS;
-    chunk_seq_number = malloc(chunks*sizeof(size_t));
-    bytes_per_chunk = malloc(chunks*sizeof(size_t));
-
-    printf("bytes to send: %d\nchunks=%d\n", bytes_to_send, chunks);
-
-    for(int i=0; i<chunks ; i++){
-      
-      memcpy(data_per_chunk, temp, bytes_to_send);
-      
-      /*make header*/
-      sendmssg.header.control = ACK;
-      sendmssg.header.ack_number = socket->ack_number;
-      sendmssg.header.seq_number = socket->seq_number;
-      sendmssg.header.window = MICROTCP_RECVBUF_LEN - socket->buf_fill_level;
-      sendmssg.header.data_len = bytes_to_send; //TODO FIND DATALEN !!!!!!!!!!!!!!!!!!!//////////////////////////////////////////////////
-      sendmssg.data = data_per_chunk;
-      /*keep the sequence number of this chunk*/
-      chunk_seq_number[i] = socket->seq_number;
-      bytes_per_chunk[i] = bytes_to_send;
-
-      /*compute checksum*/
-      /*assuming that the buffer already has the header and the data ready to be sent on the buffer and has 0 on the CRC32 field of the header...*/
-      checksum = crc32(&sendmssg, sizeof(message_t));
-      sendmssg.header.checksum = checksum;
-      
-      bytes_sent = sendto(socket->sd, &sendmssg, sizeof(message_t), flags, socket->destaddr, dest_len);
-      if (bytes_sent == -1)
-      {
-        printf("Error in sending the message to server\n");
-        fprintf(stderr, "Error: %s\n", strerror(errno));
-        socket->packets_lost++;
-        socket->bytes_lost += bytes_to_send;
-        return -1;
-      }
+  return (enable && !(socket->gso && socket->gro)) ? -1 : 0;
+}
 
-      /*sendto was successful, update socket's values to be used on next header*/
-      socket->bytes_send += bytes_sent;
-      total_bytes_sent += bytes_sent;
-      socket->packets_send++;
-      socket->seq_number += bytes_sent;
-      socket->curr_win_size += bytes_sent;
-
-      /*we have sent the first bytes_sent bytes of data*/
-      temp = (temp + sendmssg.header.data_len);
-    }
-
-    /* Check if there is a semi - filled chunk*/
-    if(bytes_to_send % MICROTCP_MSS){
-      printf("INSIDE THE UNFILLED CHUNK: %d\n", bytes_to_send % MICROTCP_MSS);
-      chunks++;
-      chunk_seq_number = realloc(chunk_seq_number, chunks*sizeof(size_t));
-      bytes_per_chunk = realloc(bytes_per_chunk, chunks*sizeof(size_t));
-
-      memcpy(data_per_chunk, temp, bytes_to_send % MICROTCP_MSS);
-      //printf("sizeof(*data_per_chunk)=%d\n", sizeof(*data_per_chunk));
-      
-      /*make header*/
-      sendmssg.header.control = ACK;
-      sendmssg.header.ack_number = socket->ack_number;
-      sendmssg.header.seq_number = socket->seq_number;
-      sendmssg.header.window = MICROTCP_RECVBUF_LEN - socket->buf_fill_level;
-      sendmssg.data = data_per_chunk;
-      sendmssg.header.data_len = sizeof(*data_per_chunk);
-      chunk_seq_number[chunks-1] = socket->seq_number;
-      bytes_per_chunk[chunks-1] = bytes_to_send % MICROTCP_MSS;
-
-      /*compute checksum*/
-      /*assuming that the buffer already has the header and the data ready to be sent on the buffer and has 0 on the CRC32 field of the header...*/
-      checksum = crc32(&sendmssg, sizeof(message_t));
-      sendmssg.header.checksum = checksum;
-      printf("sendingChecksum: %d\n", sendmssg.header.checksum);
-
-      printf("Sending message %d with payload %d\n", sendmssg.data, sendmssg.header.data_len);
-      printf("Sending ack=%d, control=%d, seq=%d, window=%d\n", sendmssg.header.ack_number, sendmssg.header.control, sendmssg.header.seq_number, sendmssg.header.window);
-      
-      bytes_sent = sendto(socket->sd, &sendmssg, sizeof(message_t), flags, socket->destaddr, dest_len);
-      if (bytes_sent == -1)
-      {
-        printf("Error in sending the message to server\n");
-        fprintf(stderr, "Error: %s\n", strerror(errno));
-        socket->packets_lost++;
-        socket->bytes_lost += bytes_to_send;
-        return -1;
-      }
+int
+microtcp_set_congestion_control (microtcp_sock_t *socket, const char *name)
+{
+  const microtcp_cc_ops_t *cc = microtcp_cc_find(name);
 
-      printf("bytes_sent = %d\n", bytes_sent);
-
-      /*sendto was successful, update socket's values to be used on next header*/
-      socket->bytes_send += bytes_sent;
-      total_bytes_sent += bytes_sent;
-      socket->packets_send++;
-      socket->seq_number += bytes_sent;
-      socket->curr_win_size += bytes_sent;
-
-      /*we have sent the first bytes_sent bytes of data, moving the head of the array will get us to the next byte of data that needs to be sent*/
-      temp = (temp + sendmssg.header.data_len);
-    }
-
-    /* Get the ACKs */
-    for(int i = 0; i < chunks; i++){ 
-      bytes_received = recvfrom(socket->sd, (void *restrict)temp, MICROTCP_RECVBUF_LEN - socket->buf_fill_level, flags, (struct sockaddr *restrict)src_address, (socklen_t *restrict)&src_len);
-      if(bytes_received < 0){
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-          /*timeout*/
-          fprintf(stderr, "Receive timeout occurred\n");
-          socket->ssthresh = socket->cwnd/2;
-          socket->cwnd = MIN(MICROTCP_MSS,socket->ssthresh);
-          
-          /*retransmit*/
-          int k;
-          /*for each packet after the one that i have to retransmit (including the packet that caused the retransmition)...*/
-          for(k=i; k<chunks; k++){
-            /*make header*/
-            sendmssg.header.control = ACK;
-            sendmssg.header.ack_number = socket->ack_number;
-            sendmssg.header.seq_number = chunk_seq_number[k];
-            sendmssg.header.window = MICROTCP_RECVBUF_LEN - socket->buf_fill_level;
-            memcpy(sendmssg.data, (buffer + recvmssg.header.ack_number), bytes_per_chunk[k]);
-            sendmssg.header.data_len = sizeof(*data_per_chunk);
-
-            /*compute checksum*/
-            /*assuming that the buffer already has the header and the data ready to be sent on the buffer and has 0 on the CRC32 field of the header...*/
-            checksum = crc32(&sendmssg, sizeof(message_t));
-            sendmssg.header.checksum = checksum;
-            
-            bytes_sent = sendto(socket->sd, &sendmssg, sizeof(message_t), flags, socket->destaddr, dest_len);
-            if (bytes_sent == -1)
-            {
-              printf("Error in sending the message to server\n");
-              fprintf(stderr, "Error: %s\n", strerror(errno));
-              socket->packets_lost++;
-              socket->bytes_lost += bytes_to_send;
-              return -1;
-            }
-          }
-          /*decrease i so that in the next for loop it will remain the same as in this*/
-          //i--;  /*comment out to not get an endless loop because of segfault on the server*/
-          prev_ack = recvmssg.header.ack_number;
-          continue;
-        } else {
-          printf("Error in receiving the message in socket <%d>\n", socket->sd);
-          fprintf(stderr, "Error: %s\n", strerror(errno));
-          return -1;
-        }
-      }
+  if (cc == NULL) return -1;
 
-      memcpy(&recvmssg, temp, sizeof(message_t));
-      socket->curr_win_size -= recvmssg.header.data_len;
-      socket->recvbuf = recvmssg.data;
-      socket->buf_fill_level += recvmssg.header.data_len;
-
-      if(recvmssg.header.window == 0){
-        /*keep sending a special package with 0 payload until you receive an ACK with window!=0*/
-        while(recvmssg.header.window==0){
-          /*wait a rand ammount of time before sending the special package*/
-          srand((unsigned int)time(NULL));
-          unsigned int randomTime = rand() % (MICROTCP_ACK_TIMEOUT_US + 1);
-          usleep(randomTime);
-
-          memset(&sendmssg, 0, sizeof(sendmssg));
-          sendmssg.header.ack_number = socket->ack_number;
-          sendmssg.header.seq_number = recvmssg.header.ack_number;
-          sendmssg.header.control = ACK;
-          sendmssg.header.data_len = 0; /*payload=0*/
-
-          printf("Sending special package with 0 payload\n");
-          if (sendto(socket->sd, &sendmssg, sizeof(message_t), 0, socket->destaddr, dest_len) == -1)
-          {
-            printf("Error in sending the message to client\n");
-            fprintf(stderr, "Error: %s\n", strerror(errno));
-            return -1;
-          }
-
-          if(recvfrom(socket->sd, (void *restrict)temp, MICROTCP_RECVBUF_LEN - socket->buf_fill_level, flags, (struct sockaddr *restrict)src_address, (socklen_t *restrict)&src_len)==-1){
-            printf("Error in receiving the message in socket <%d>\n", socket->sd);
-            fprintf(stderr, "Error: %s\n", strerror(errno));
-            return -1;
-          }
-          memcpy(&recvmssg, temp, sizeof(recvmssg));
-        }
-        
-        /*retransmit*/
-        int k;
-        /*for each packet after the one that i have to retransmit (including the packet that caused the retransmition)...*/
-        for(k=i; k<chunks; k++){
-          /*make header*/
-          sendmssg.header.control = ACK;
-          sendmssg.header.ack_number = socket->ack_number;
-          sendmssg.header.seq_number = chunk_seq_number[k];
-          sendmssg.header.window = MICROTCP_RECVBUF_LEN - socket->buf_fill_level;
-          memcpy(sendmssg.data, (buffer + recvmssg.header.ack_number), bytes_per_chunk[k]);
-          sendmssg.header.data_len = sizeof(*data_per_chunk);
-
-          /*compute checksum*/
-          /*assuming that the buffer already has the header and the data ready to be sent on the buffer and has 0 on the CRC32 field of the header...*/
-          checksum = crc32(&sendmssg, sizeof(message_t));
-          sendmssg.header.checksum = checksum;
-          
-          bytes_sent = sendto(socket->sd, &sendmssg, sizeof(message_t), flags, socket->destaddr, dest_len);
-          if (bytes_sent == -1)
-          {
-            printf("Error in sending the message to server\n");
-            fprintf(stderr, "Error: %s\n", strerror(errno));
-            socket->packets_lost++;
-            socket->bytes_lost += bytes_to_send;
-            return -1;
-          }
-        }
-        /*decrease i so that in the next for loop it will remain the same as in this*/
-        i--;
+  socket->cc = cc;
+  if (socket->state == ESTABLISHED) cc->init(socket);
 
-      } else {
-        /*congestion control*/
-        if(recvmssg.header.ack_number == prev_ack){
-          dupACKs++;
-        } else {
-          if(socket->cwnd<=socket->ssthresh){
-            /*slow start*/
-            socket->cwnd + MICROTCP_MSS;
-          } else if (socket->cwnd > socket->ssthresh) {
-            /*congestion avoidance*/
-            socket->cwnd += MICROTCP_MSS * (MICROTCP_MSS/socket->cwnd);
-          }
-
-          if(dupACKs > 0) dupACKs = 0;
-        }
+  return 0;
+}
 
-        if(dupACKs==3){
-          /*fast recovery*/
-          fprintf(stderr, "3 duplicate ACKs occured, retransmit missing package");
-          socket->ssthresh = socket->cwnd/2;
-          socket->cwnd = socket->cwnd/2 + 1;
-
-          /*retransmit*/
-          int k;
-          /*for each packet after the one that i have to retransmit (including the packet that caused the retransmition)...*/
-          for(k=i; k<chunks; k++){
-            /*make header*/
-            sendmssg.header.control = ACK;
-            sendmssg.header.ack_number = socket->ack_number;
-            sendmssg.header.seq_number = chunk_seq_number[k];
-            sendmssg.header.window = MICROTCP_RECVBUF_LEN - socket->buf_fill_level;
-            memcpy(sendmssg.data, (buffer + recvmssg.header.ack_number), bytes_per_chunk[k]);
-            sendmssg.header.data_len = sizeof(*data_per_chunk);
-
-            /*compute checksum*/
-            /*assuming that the buffer already has the header and the data ready to be sent on the buffer and has 0 on the CRC32 field of the header...*/
-            checksum = crc32(&sendmssg, sizeof(message_t));
-            sendmssg.header.checksum = checksum;
-            
-            bytes_sent = sendto(socket->sd, &sendmssg, sizeof(message_t), flags, socket->destaddr, dest_len);
-            if (bytes_sent == -1)
-            {
-              printf("Error in sending the message to server\n");
-              fprintf(stderr, "Error: %s\n", strerror(errno));
-              socket->packets_lost++;
-              socket->bytes_lost += bytes_to_send;
-              return -1;
-            }
-          }
-          /*decrease i so that in the next for loop it will remain the same as in this*/
-          i--;
-
-          /*make dupACKs counter 0 since the retransmition is done and wait for the correct ACK*/
-          dupACKs = 0;
-        }
-      }
+int
+microtcp_set_pacing (microtcp_sock_t *socket, int enable)
+{
+  socket->pacing = enable != 0;
+  socket->pace_next_us = 0;
+
+  return 0;
+}
+
+int
+microtcp_set_timeout (microtcp_sock_t *socket, uint64_t timeout_us)
+{
+  socket->user_timeout_us = timeout_us;
+
+  return 0;
+}
 
-      prev_ack = recvmssg.header.ack_number;
+/*true if the socket has the UDP socket in the epoll set, the connections of a listener use the one of the listener*/
+static int
+loop_owns_sd (const microtcp_sock_t *socket)
+{
+  return socket->listener == NULL || socket->state == LISTEN;
+}
+
+static struct microtcp_loop_entry *
+loop_find (microtcp_loop_t *loop, const microtcp_sock_t *socket, int *idx)
+{
+  for (int i = 0; i < loop->count; i++) {
+    if (loop->entries[i]->socket == socket) {
+      if (idx != NULL) *idx = i;
+      return loop->entries[i];
     }
+  }
+  return NULL;
+}
+
+/*the events pending on the socket*/
+static uint32_t
+loop_ready (microtcp_sock_t *socket)
+{
+  uint32_t events = 0;
+
+  if (socket->state == LISTEN) return socket->listener->backlog_count > 0 ? MICROTCP_POLLIN : 0;
+
+  if (socket->buf_fill_level > 0 || socket->state == CLOSING_BY_PEER) events |= MICROTCP_POLLIN;
+  if (socket->state == ESTABLISHED && send_space(socket) > 0) events |= MICROTCP_POLLOUT;
+  if (socket->state == CLOSING_BY_PEER || socket->state == CLOSED) events |= MICROTCP_POLLHUP;
+
+  return events;
+}
+
+/*true if a connection of a listener has segments in its queue that it has not processed yet*/
+static int
+demux_pending (microtcp_sock_t *socket)
+{
+  return socket->listener != NULL && socket->state != LISTEN && socket->pool != NULL
+         && socket->pool->rx.q_count > socket->pool->rx.q_taken;
+}
+
+/*true if a ring already holds completed receives its descriptor does not report or that the last batch left*/
+static int
+ring_pending (microtcp_sock_t *socket)
+{
+  struct microtcp_rxbatch *rx;
+
+  if (!loop_owns_sd(socket)) return 0;
+  rx = socket->state == LISTEN ? &socket->listener->rx : socket->pool != NULL ? &socket->pool->rx : NULL;
+  return rx != NULL && rx->ring != NULL && (rx->left > 0 || microtcp_uring_pending(rx->ring));
+}
+
+/*processes every segment that waits for the connection*/
+static void
+loop_drain (microtcp_sock_t *socket)
+{
+  while (socket->state == ESTABLISHED && socket->pool != NULL && conn_input(socket, 0) != -1);
+}
 
-    remaining -= bytes_to_send;
+/*the UDP socket of the entry is readable. the segments of a listener are handed to the queues of its
+ *connections, which are drained as the UDP socket of a plain connection is*/
+static void
+loop_input (microtcp_loop_t *loop, struct microtcp_loop_entry *entry)
+{
+  microtcp_sock_t *socket = entry->socket;
+  struct microtcp_listener *listener = socket->listener;
 
-    data_sent+=bytes_to_send;
+  if (socket->state != LISTEN) {
+    loop_drain(socket);
+    return;
+  }
 
+  while (listener_pump(listener, MSG_DONTWAIT) != -1);
+  for (int i = 0; i < loop->count; i++) {
+    if (loop->entries[i]->socket->listener == listener && loop->entries[i]->socket != socket) loop_drain(loop->entries[i]->socket);
   }
-  return total_bytes_sent;
 }
 
-ssize_t
-microtcp_recv (microtcp_sock_t *socket, void *buffer, size_t length, int flags)
+/*runs the timers that expired and sets the timerfd to the next one of the wheel*/
+static void
+loop_timers (microtcp_loop_t *loop)
 {
-  struct sockaddr *src_address = malloc(sizeof(struct sockaddr));
-  socklen_t src_len = sizeof(struct sockaddr);
+  struct itimerspec its;
+  uint64_t earliest;
 
-  message_t *recvmssg = malloc(sizeof(message_t));
-  message_t *sendmssg = malloc(sizeof(message_t));
-  uint32_t receivedChecksum, calculatedChecksum;
-  int total_bytes_received=0;
+  timers_run(&loop->wheel);
+  earliest = microtcp_wheel_next(&loop->wheel);
 
-  /*set the receive timeout time with the code given*/
-  struct timeval timeout;
-  timeout. tv_sec = 0;
-  timeout. tv_usec =MICROTCP_ACK_TIMEOUT_US; 
-  if (setsockopt(socket->sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( struct timeval)) < 0) {
-    perror("setsockopt");
+  if (earliest == loop->timer_us) return;
+
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = earliest / 1000000;
+  its.it_value.tv_nsec = (earliest % 1000000) * 1000;
+  if (timerfd_settime(loop->tfd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+    perror("timerfd_settime");
+    return;
+  }
+  loop->timer_us = earliest;
+}
+
+microtcp_loop_t *
+microtcp_loop_create (void)
+{
+  struct epoll_event ev;
+  microtcp_loop_t *loop = calloc(1, sizeof(microtcp_loop_t));
+
+  if (loop == NULL) return NULL;
+
+  microtcp_wheel_init(&loop->wheel, now_us());
+  loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+  loop->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (loop->epfd == -1 || loop->tfd == -1) {
+    perror("microtcp_loop_create");
+    microtcp_loop_free(loop);
+    return NULL;
   }
 
-  memset(recvmssg, 0, sizeof(message_t));
-  memset(sendmssg, 0, sizeof(message_t));
-  memset(&receivedChecksum, 0, sizeof(receivedChecksum));
-  memset(&calculatedChecksum, 0, sizeof(calculatedChecksum));
+  /*the timerfd is the entry without a socket*/
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->tfd, &ev) == -1) {
+    perror("epoll_ctl");
+    microtcp_loop_free(loop);
+    return NULL;
+  }
 
-  /*receive the message*/
+  return loop;
+}
 
-  int bytes_received = recvfrom(socket->sd, (void *restrict)buffer, length, flags, (struct sockaddr *restrict)src_address, (socklen_t *restrict)&src_len);
-  if (bytes_received == -1)
-  {
-    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-      /*timeout*/
-      fprintf(stderr, "Receive timeout occurred\n");
-      /*send dupACK*/
-      sendmssg->header.ack_number = socket->ack_number;
-      sendmssg->header.control = ACK;
-
-      printf("Sending dupACK, ack=%d\n", sendmssg->header.ack_number);
-      if (sendto(socket->sd, sendmssg, sizeof(message_t), 0, socket->destaddr, cl_len) == -1)
-      {
-        printf("Error in sending the message to client\n");
-        fprintf(stderr, "Error: %s\n", strerror(errno));
+int
+microtcp_loop_add (microtcp_loop_t *loop, microtcp_sock_t *socket, uint32_t events, void *data)
+{
+  struct microtcp_loop_entry *entry = loop_find(loop, socket, NULL);
+  struct microtcp_loop_entry **entries;
+  struct microtcp_uring *ring;
+  struct epoll_event ev;
+
+  if (entry == NULL) {
+    /*only listeners and connections*/
+    if (socket->state == LISTEN ? socket->listener == NULL : socket->pool == NULL) return -1;
+
+    if (loop->count == loop->size) {
+      entries = realloc(loop->entries, (loop->size ? 2 * loop->size : 16) * sizeof(*entries));
+      if (entries == NULL) return -1;
+      loop->entries = entries;
+      loop->size = loop->size ? 2 * loop->size : 16;
+    }
+    entry = malloc(sizeof(*entry));
+    if (entry == NULL) return -1;
+    entry->socket = socket;
+    entry->fd = -1;
+
+    if (loop_owns_sd(socket)) {
+      /*with io_uring the datagrams arrive as completions of the ring*/
+      ring = socket->state == LISTEN ? socket->listener->rx.ring : socket->pool->rx.ring;
+      entry->fd = ring != NULL ? microtcp_uring_fd(ring) : socket->sd;
+      ev.events = EPOLLIN;
+      ev.data.ptr = entry;
+      if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, entry->fd, &ev) == -1) {
+        perror("epoll_ctl");
+        free(entry);
         return -1;
       }
-    } else {
-      printf("Error in receiving the message in socket <%d>\n", socket->sd);
-      fprintf(stderr, "Error: %s\n", strerror(errno));
-      return -1;
     }
+    loop->entries[loop->count++] = entry;
+    /*from now on the poll of the loop runs the timers of the connection*/
+    if (socket->state != LISTEN) timers_move(socket, &loop->wheel);
   }
 
-  /* print for debug: printf("bytes_received = %d\n", bytes_received);*/
+  entry->events = events;
+  entry->data = data;
+
+  return 0;
+}
 
-  memcpy(recvmssg, buffer, sizeof(message_t));
+int
+microtcp_loop_del (microtcp_loop_t *loop, microtcp_sock_t *socket)
+{
+  struct microtcp_loop_entry *entry;
+  int idx;
 
-  /*prints for debug*/
-  // printf("Received message %d with payload %d\n", recvmssg->data, recvmssg->header.data_len);
-  // printf("Received ack=%d, control=%d, seq=%d, window=%d\n", recvmssg->header.ack_number, recvmssg->header.control, recvmssg->header.seq_number, recvmssg->header.window);
+  if ((entry = loop_find(loop, socket, &idx)) == NULL) return -1;
 
-  /*check checksum*/
-  receivedChecksum = recvmssg->header.checksum;
-  printf("receivedChecksum: %d\n", receivedChecksum);
-  recvmssg->header.checksum=0;
-  printf("header checksum: %d\n", recvmssg->header.checksum);
-  calculatedChecksum = crc32(recvmssg, sizeof(message_t));
-  printf("calculatedChecksum: %d\n", calculatedChecksum);
+  if (entry->fd != -1) epoll_ctl(loop->epfd, EPOLL_CTL_DEL, entry->fd, NULL);
+  if (socket->pool != NULL && socket->pool->timers == &loop->wheel) timers_move(socket, NULL);
+  loop->entries[idx] = loop->entries[--loop->count];
+  free(entry);
 
-  if(receivedChecksum != calculatedChecksum){
-    /*corrupted package, send dupACK*/
-    fprintf(stderr, "Wrong checksum, package corrupted\n");
-    sendmssg->header.ack_number = socket->ack_number;
-    sendmssg->header.control = ACK;
+  return 0;
+}
 
-    printf("Sending dupACK, ack=%d\n", sendmssg->header.ack_number);
-    if (sendto(socket->sd, sendmssg, sizeof(message_t), 0, socket->destaddr, sizeof(struct sockaddr_in)) == -1)
-    {
-      printf("Error in sending the message to client\n");
-      fprintf(stderr, "Error: %s\n", strerror(errno));
-      return -1;
+int
+microtcp_poll (microtcp_loop_t *loop, microtcp_event_t *events, int maxevents, int timeout_ms)
+{
+  struct epoll_event evs[MICROTCP_BATCH];
+  struct microtcp_loop_entry *entry;
+  uint64_t deadline = now_us() + (uint64_t)(timeout_ms > 0 ? timeout_ms : 0) * 1000;
+  uint64_t expirations;
+  uint32_t ready;
+  int wait = 0;
+  int nev, n;
+
+  if (maxevents <= 0) return -1;
+
+  for (;;) {
+    nev = epoll_wait(loop->epfd, evs, MICROTCP_BATCH, wait);
+    if (nev == -1) return -1;
+
+    for (int i = 0; i < nev; i++) {
+      if (evs[i].data.ptr == NULL) {
+        if (read(loop->tfd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) perror("read");
+        loop->timer_us = 0;
+      } else {
+        loop_input(loop, evs[i].data.ptr);
+      }
     }
-  } else {
-    /*correct checksum*/
-    socket->bytes_received += bytes_received;
-    total_bytes_received += bytes_received;
-    socket->packets_received++;
-
-    /*first check for FIN ACK*/
-    if (recvmssg->header.control == (FIN|ACK)){
-      socket->state = CLOSING_BY_PEER;
-      /*call shutdown*/
-      return -1;
+    /*segments a connection of a listener pumped for the others wait in their queues, not in the socket*/
+    for (int i = 0; i < loop->count; i++) {
+      if (ring_pending(loop->entries[i]->socket)) loop_input(loop, loop->entries[i]);
+      if (demux_pending(loop->entries[i]->socket)) loop_drain(loop->entries[i]->socket);
     }
+    loop_timers(loop);
+
+    /*report from where the previous call stopped*/
+    n = 0;
+    for (int i = 0; i < loop->count && n < maxevents; i++) {
+      entry = loop->entries[(loop->next + i) % loop->count];
+      ready = loop_ready(entry->socket) & (entry->events | MICROTCP_POLLHUP);
+      if (ready == 0) continue;
+
+      events[n].socket = entry->socket;
+      events[n].events = ready;
+      events[n].data = entry->data;
+      n++;
+      if (n == maxevents) loop->next = (loop->next + i + 1) % loop->count;
+    }
+    if (n > 0 || timeout_ms == 0) return n;
 
-    if(recvmssg->header.seq_number == socket->ack_number){
-      /*everything good, i got the correct package*/
-      //printf("trww seg edw\n");
-      memcpy(socket->recvbuf, recvmssg->data, recvmssg->header.data_len);   //????????
-      socket->buf_fill_level += recvmssg->header.data_len;
-      
-      sendmssg->header.ack_number = recvmssg->header.seq_number + recvmssg->header.data_len;
-      socket->ack_number = sendmssg->header.ack_number;
-      sendmssg->header.window -= recvmssg->header.data_len;
-      socket->curr_win_size -= recvmssg->header.data_len;
-      sendmssg->header.control = ACK;
-      
-      printf("Sending ACK, ack=%d\n", sendmssg->header.ack_number);
-      if (sendto(socket->sd, sendmssg, sizeof(message_t), 0, socket->destaddr, sizeof(struct sockaddr_in)) == -1)
-      {
-        printf("Error in sending the message to client\n");
-        fprintf(stderr, "Error: %s\n", strerror(errno));
-        return -1;
-      }
+    if (timeout_ms < 0) {
+      wait = -1;
     } else {
-      /*i got the wrong package*/
-      sendmssg->header.ack_number = socket->ack_number;
-      sendmssg->header.control = ACK;
+      uint64_t now = now_us();
 
-      printf("Sending dupACK, ack=%d\n", sendmssg->header.ack_number);
-      if (sendto(socket->sd, sendmssg, sizeof(message_t), 0, socket->destaddr, sizeof(struct sockaddr_in)) == -1)
-      {
-        printf("Error in sending the message to client\n");
-        fprintf(stderr, "Error: %s\n", strerror(errno));
-        return -1;
-      }
+      if (now >= deadline) return 0;
+      wait = (deadline - now + 999) / 1000;
     }
   }
+}
 
-  return total_bytes_received;
+void
+microtcp_loop_free (microtcp_loop_t *loop)
+{
+  microtcp_sock_t *socket;
+
+  if (loop == NULL) return;
+
+  for (int i = 0; i < loop->count; i++) {
+    /*the sockets outlive the loop, their timers go back to their own wheels*/
+    socket = loop->entries[i]->socket;
+    if (socket->pool != NULL && socket->pool->timers == &loop->wheel) timers_move(socket, NULL);
+    free(loop->entries[i]);
+  }
+  free(loop->entries);
+  if (loop->epfd != -1) close(loop->epfd);
+  if (loop->tfd != -1) close(loop->tfd);
+  free(loop);
 }
 
 /*our functions*/
@@ -35,12 +35,46 @@
 /*
  * Several useful constants
  */
-#define MICROTCP_ACK_TIMEOUT_US 200000
-#define MICROTCP_MSS 1400
-#define MICROTCP_RECVBUF_LEN 8192
+#define MICROTCP_ACK_TIMEOUT_US 200000  /* The RTO until the first RTT sample */
+#define MICROTCP_MIN_RTO_US 2000
+#define MICROTCP_MAX_RTO_US 60000000
+#define MICROTCP_DELACK_US 1000  /* How long an ACK waits for a second segment, below MICROTCP_MIN_RTO_US */
+#define MICROTCP_QUICKACKS 16  /* ACKs that are not delayed after the handshake and after a loss */
+#define MICROTCP_PACING_BURST_US 1000  /* The most sending time a paced socket saves up for a burst */
+#ifndef MICROTCP_MSS
+#define MICROTCP_MSS 1400  /* A build may pick another with -DMICROTCP_MSS=..., both ends must agree */
+#endif
+#define MICROTCP_RECVBUF_LEN 8192  /* The default, and smallest, receive buffer */
+#define MICROTCP_RECVBUF_MAX (16 * 1024 * 1024)
 #define MICROTCP_WIN_SIZE MICROTCP_RECVBUF_LEN
 #define MICROTCP_INIT_CWND (3 * MICROTCP_MSS)
-#define MICROTCP_INIT_SSTHRESH MICROTCP_WIN_SIZE
+#define MICROTCP_INIT_SSTHRESH MICROTCP_RECVBUF_MAX  /* As large as any window, slow start runs until the first loss (RFC 5681) */
+#define MICROTCP_OOO_MAX_BLOCKS 32
+#define MICROTCP_SACK_MAX_BLOCKS 8
+#define MICROTCP_BATCH 64  /* Segments moved by one sendmmsg/recvmmsg */
+#define MICROTCP_TXQ_SEGS 2048  /* Segments of the pool, the most that can be in flight, allocated as the window needs them */
+#define MICROTCP_MAX_WSCALE 14
+
+/*
+ * OR-ed in the type of microtcp_socket(), as SOCK_NONBLOCK in socket():
+ * microtcp_send() and microtcp_recv() return -1 with errno EAGAIN instead
+ * of waiting. The handshakes and microtcp_shutdown() still block.
+ */
+#define MICROTCP_NONBLOCK SOCK_NONBLOCK
+
+/*
+ * OR-ed in the type of microtcp_socket(): the data path of the socket
+ * goes through io_uring, see microtcp_uring.h. Where the kernel has no
+ * usable io_uring the socket stays with the plain system calls.
+ */
+#define MICROTCP_IO_URING 0x40000000
+
+/*
+ * Events of microtcp_poll()
+ */
+#define MICROTCP_POLLIN 0x1   /* microtcp_recv() or microtcp_accept_conn() will not block */
+#define MICROTCP_POLLOUT 0x2  /* microtcp_send() can queue at least one byte */
+#define MICROTCP_POLLHUP 0x4  /* The peer closed the connection */
 
 /*our defines*/
 #define ACK (0b1 << 12)
@@ -48,6 +82,23 @@
 #define SYN (0b1 << 14)
 #define FIN (0b1 << 15)
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+
+/*sequence number comparisons that survive the wrap around of the 32-bit header fields*/
+#define SEQ_LT(a, b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)) <= 0)
+#define SEQ_GT(a, b) SEQ_LT(b, a)
+#define SEQ_GEQ(a, b) SEQ_LEQ(b, a)
+
+/**
+ * A contiguous range [start, end) of sequence numbers that arrived
+ * after a gap and waits in the receive buffer for the gap to fill.
+ */
+typedef struct
+{
+  uint32_t start;
+  uint32_t end;
+} microtcp_ooo_block_t;
 
 /**
  * Possible states of the microTCP socket
@@ -83,11 +134,27 @@ typedef struct
   uint8_t *recvbuf;             /**< The *receive* buffer of the TCP
                                      connection. It is allocated during the connection establishment and
                                      is freed at the shutdown of the connection. This buffer is used
-                                     to retrieve the data from the network. */
+                                     to retrieve the data from the network. It is a ring, the in-order
+                                     data starts at recvbuf_head. */
+  size_t recvbuf_len;           /**< Size of the receive buffer, a power of two */
+  size_t recvbuf_head;          /**< Index of the first byte the user has not received yet */
+  int recvbuf_autotune;         /**< Grow the receive buffer with the bandwidth-delay product */
+  size_t rcv_copied;            /**< Bytes handed over to the user since rcv_epoch_us */
+  uint64_t rcv_epoch_us;        /**< Start of the current autotuning measurement */
   size_t buf_fill_level;        /**< Amount of data in the buffer */
+  uint8_t rcv_wscale;           /**< Shift of the windows we advertise, negotiated at the handshake */
+  uint16_t rcv_adv;             /**< The window we advertised last */
+  size_t rcv_acked;             /**< The ACK number we sent last, the data after it waits for a delayed ACK */
+  int rcv_quickack;             /**< ACKs left that are not delayed, while the sender grows its window */
+  uint8_t snd_wscale;           /**< Shift of the windows the peer advertises */
+  microtcp_ooo_block_t ooo[MICROTCP_OOO_MAX_BLOCKS]; /**< Out-of-order data stored in the buffer after
+                                     the in-order data, sorted by sequence number */
+  int ooo_blocks;               /**< Number of the out-of-order blocks */
 
   size_t cwnd;
   size_t ssthresh;
+  const struct microtcp_cc_ops *cc; /**< The congestion control algorithm, see microtcp_cc.h */
+  uint64_t cc_priv[24];         /**< Private state of the congestion control algorithm */
 
   size_t seq_number;            /**< Keep the state of the sequence number */
   size_t ack_number;            /**< Keep the state of the ack number */
@@ -101,8 +168,63 @@ typedef struct
   /*our fields*/
   const struct sockaddr *myaddr;
   const struct sockaddr *destaddr;
+  socklen_t destaddr_len;
+
+  size_t snd_una;               /**< The oldest sequence number that is not ACKed yet */
+  size_t recover;               /**< Highest sequence number sent when the last fast retransmit happened */
+  int dupACKs;                  /**< Consecutive duplicate ACKs received */
+  struct microtcp_txseg *txq_head;  /**< Retransmission queue, oldest segment first */
+  struct microtcp_txseg *txq_tail;
+  struct microtcp_pool *pool;   /**< Every buffer of the data path, allocated once at the connection
+                                     establishment and freed when the connection closes */
+  struct microtcp_listener *listener; /**< The listener whose UDP socket the connection shares,
+                                     NULL if the connection has a socket of its own */
+  uint8_t gso;                  /**< Send runs of full segments as one UDP_SEGMENT buffer */
+  uint8_t gro;                  /**< Accept UDP_GRO coalesced buffers */
+  int sack_permitted;           /**< Both sides agreed on SACK at the handshake */
+  size_t sack_high;             /**< End of the highest SACKed block */
+  uint32_t rtx_epoch;           /**< Counts the loss recoveries, so a hole is retransmitted once in each */
+
+  uint64_t srtt_us;             /**< Smoothed RTT, 0 until the first sample */
+  uint64_t latest_rtt_us;       /**< The most recent RTT sample */
+  uint64_t rttvar_us;           /**< RTT variation */
+  uint64_t rto_us;              /**< Retransmission timeout, backed off exponentially on every expiration */
+  uint64_t rto_deadline_us;     /**< When the retransmission (or persist) timer expires */
+  uint64_t rcvtimeo_us;         /**< The SO_RCVTIMEO currently set on the UDP socket */
+  uint8_t nonblock;             /**< Created with MICROTCP_NONBLOCK */
+  uint8_t io_uring;             /**< Created with MICROTCP_IO_URING and the kernel supports it */
+  uint8_t persist;              /**< A non-blocking send found the window closed, probe it until it opens */
+  uint8_t pacing;               /**< Spread the segments over the round trip, see microtcp_set_pacing() */
+  uint64_t pace_next_us;        /**< When the pacing lets the next segment leave */
+  uint64_t user_timeout_us;     /**< How long a blocking call waits for the peer, 0 for ever,
+                                     see microtcp_set_timeout() */
 } microtcp_sock_t;
 
+/**
+ * A set of microTCP sockets that one thread serves with microtcp_poll().
+ */
+typedef struct microtcp_loop microtcp_loop_t;
+
+/**
+ * A socket of the set with the events that are pending on it.
+ */
+typedef struct
+{
+  microtcp_sock_t *socket;
+  uint32_t events;              /**< MICROTCP_POLLIN, MICROTCP_POLLOUT and MICROTCP_POLLHUP */
+  void *data;                   /**< What microtcp_loop_add() was given for the socket */
+} microtcp_event_t;
+
+/**
+ * The work of a thread of microtcp_serve(). It runs with a listener of
+ * its own, accepts from it and serves its connections until it returns.
+ *
+ * @param listener the listener of the worker, after microtcp_listen()
+ * @param worker the number of the worker, from 0
+ * @param arg what microtcp_serve() was given
+ */
+typedef void (*microtcp_worker_fn) (microtcp_sock_t *listener, int worker, void *arg);
+
 
 /**
  * microTCP header structure
@@ -122,12 +244,49 @@ typedef struct
 } microtcp_header_t;
 
 
-/*our vars*/
+/**
+ * On-the-wire microTCP segment: the header, the option block and the
+ * payload, at most MICROTCP_MSS bytes for both. Only the first
+ * MICROTCP_SEGMENT_LEN() bytes are put on the wire.
+ */
 typedef struct{
   microtcp_header_t header;
-  void *data;
+  uint8_t data[MICROTCP_MSS];
 } message_t;
 
+/*
+ * future_use0 carries the microTCP options:
+ *   bits 0-7   number of SACK blocks (microtcp_ooo_block_t) in the option
+ *              block that follows the header, before the payload
+ *   bit  8     SACK permitted, sent on SYN and SYN ACK
+ *   bits 9-12  window scale shift, sent on SYN and SYN ACK (RFC 7323)
+ *   bit  13    window scale present, the shift is valid
+ */
+#define MICROTCP_OPT_SACK_BLOCKS(h) ((h)->future_use0 & 0xff)
+#define MICROTCP_OPT_SACK_PERMITTED (1 << 8)
+#define MICROTCP_OPT_WSCALE_PRESENT (1 << 13)
+#define MICROTCP_OPT_WSCALE(shift) (MICROTCP_OPT_WSCALE_PRESENT | ((uint32_t)(shift) << 9))
+#define MICROTCP_OPT_WSCALE_SHIFT(h) (((h)->future_use0 >> 9) & 0xf)
+#define MICROTCP_OPT_LEN(h) (MICROTCP_OPT_SACK_BLOCKS(h) * sizeof(microtcp_ooo_block_t))
+
+#define MICROTCP_SEGMENT_LEN(m) (sizeof(microtcp_header_t) + MICROTCP_OPT_LEN(&(m)->header) + (m)->header.data_len)
+#define MICROTCP_PAYLOAD(m) ((m)->data + MICROTCP_OPT_LEN(&(m)->header))
+
+/**
+ * An entry of the retransmission queue. It keeps a segment that is sent
+ * but not ACKed yet, ready to be put on the wire again.
+ */
+typedef struct microtcp_txseg
+{
+  struct microtcp_txseg *next;
+  uint8_t sacked;               /**< The receiver reported it in a SACK block */
+  uint32_t rtx_epoch;           /**< The loss recovery in which it was last retransmitted, 0 if never */
+  uint64_t sent_us;             /**< When it was first sent, for the RTT samples */
+  const uint8_t *zc_data;       /**< The payload in the buffer of the application, for microtcp_send_zc(),
+                                     NULL if it is in mssg */
+  message_t mssg;
+} microtcp_txseg_t;
+
 
 microtcp_sock_t
 microtcp_socket (int domain, int type, int protocol);
@@ -153,6 +312,69 @@ int
 microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address,
                  socklen_t address_len);
 
+/**
+ * Turns a bound socket into a listener that accepts many connections on
+ * its single UDP socket. The segments are handed to the connection of
+ * their source address and the SYNs of new peers wait in the backlog
+ * for microtcp_accept_conn().
+ *
+ * @param socket a socket after microtcp_bind()
+ * @param backlog the most SYNs that can wait, the rest are dropped
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_listen (microtcp_sock_t *socket, int backlog);
+
+/**
+ * Blocks until a SYN is in the backlog of the listener and establishes
+ * its connection. The connection sends and receives through the socket
+ * of the listener and is closed with microtcp_shutdown(), before the
+ * listener itself. The listener keeps a pointer to conn, so conn must
+ * not move until it is closed.
+ *
+ * @param socket the socket structure of the listener
+ * @param conn the socket structure of the new connection
+ * @param address pointer to store the address of the peer, can be NULL
+ * @param address_len the length of the address structure, updated with
+ * the length of the address of the peer
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_accept_conn (microtcp_sock_t *socket, microtcp_sock_t *conn, struct sockaddr *address,
+                      socklen_t *address_len);
+
+/**
+ * Lets more sockets bind to the same address (SO_REUSEPORT). The kernel
+ * hands the datagrams of each peer to one of them, always the same one
+ * while the group stays the same. It has to be called before
+ * microtcp_bind().
+ *
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_set_reuseport (microtcp_sock_t *socket);
+
+/**
+ * Runs a sharded server. Every worker is a thread, pinned to a CPU of
+ * its own while there are enough, with a listener of its own on a UDP
+ * socket bound to address with SO_REUSEPORT. A connection lives in the
+ * thread that accepted it, so the workers share no state and no lock.
+ * All the sockets are bound before the first worker starts.
+ *
+ * @param address the address every worker listens at
+ * @param address_len the length of the address
+ * @param workers the number of threads
+ * @param backlog the backlog of each listener
+ * @param type the type of the sockets, as for microtcp_socket()
+ * @param fn the work of each thread
+ * @param arg passed to fn
+ * @return 0 after every worker returned or -1 if the server could not
+ * start, then fn runs in no thread
+ */
+int
+microtcp_serve (const struct sockaddr *address, socklen_t address_len, int workers, int backlog, int type,
+                microtcp_worker_fn fn, void *arg);
+
 int
 microtcp_shutdown(microtcp_sock_t *socket, int how);
 
@@ -160,9 +382,222 @@ ssize_t
 microtcp_send (microtcp_sock_t *socket, const void *buffer, size_t length,
                int flags);
 
+/**
+ * Sends as microtcp_send() without copying the data. The segments point
+ * at the buffer, so the first transmission and the retransmissions read
+ * it in place, and the datagrams leave with MSG_ZEROCOPY where the kernel
+ * supports it. The buffer belongs to the socket until the data is ACKed
+ * and the kernel released its pages: for a blocking socket that is when
+ * the call returns, for a non-blocking one when
+ * microtcp_send_zc_pending() returns 0. It must not change before.
+ *
+ * @return as microtcp_send()
+ */
+ssize_t
+microtcp_send_zc (microtcp_sock_t *socket, const void *buffer, size_t length, int flags);
+
+/**
+ * Takes the completions of the zero-copy sends, without waiting.
+ *
+ * @return 1 while the socket still uses a buffer given to
+ * microtcp_send_zc(), 0 when they all belong to the application again
+ */
+int
+microtcp_send_zc_pending (microtcp_sock_t *socket);
+
+/**
+ * Sends count bytes of a file, starting at offset, as one
+ * microtcp_send(). A regular file is mapped and the segments are made
+ * straight from the page cache, so there is no read buffer and the
+ * window stays full across the whole file. Other descriptors are read in
+ * large windows. The offset of the descriptor does not change, except
+ * for those that cannot seek.
+ *
+ * @param socket the socket structure
+ * @param fd the file, open for reading
+ * @param offset where the data starts in the file
+ * @param count the bytes to send, fewer if the file ends before
+ * @return the bytes sent or -1 in case of error
+ */
+ssize_t
+microtcp_sendfile (microtcp_sock_t *socket, int fd, off_t offset, size_t count);
+
 ssize_t
 microtcp_recv (microtcp_sock_t *socket, void *buffer, size_t length, int flags);
 
+/**
+ * Sends the data of the iovecs, one after the other, as microtcp_send()
+ * sends a single buffer. The segments are cut regardless of where each
+ * iovec ends, so a record that is a header and a body in two buffers
+ * leaves with one call and without copying it together first.
+ *
+ * @param socket the socket structure
+ * @param iov the buffers, as for writev()
+ * @param iovcnt the number of the buffers
+ * @param flags as for microtcp_send()
+ * @return as microtcp_send(), the bytes of all the buffers
+ */
+ssize_t
+microtcp_sendmsg (microtcp_sock_t *socket, const struct iovec *iov, int iovcnt, int flags);
+
+/**
+ * Receives as microtcp_recv() and scatters the data from the receive
+ * buffer straight into the iovecs, filling each one before the next.
+ *
+ * @param socket the socket structure
+ * @param iov the buffers, as for readv()
+ * @param iovcnt the number of the buffers
+ * @param flags as for microtcp_recv()
+ * @return as microtcp_recv(), the bytes of all the buffers
+ */
+ssize_t
+microtcp_recvmsg (microtcp_sock_t *socket, const struct iovec *iov, int iovcnt, int flags);
+
+/**
+ * Receives into a file, a sink for bulk transfers. The data in order is
+ * written in the file straight from the receive buffer, without a copy in
+ * a buffer of the application, each write all of the data the buffer
+ * has so far.
+ *
+ * @param socket the socket structure
+ * @param fd the file, open for writing
+ * @param offset where the data goes in the file
+ * @param count the most bytes to receive, SIZE_MAX for all of them until
+ * the peer closes the connection
+ * @param flags as for microtcp_recv()
+ * @return the bytes written in the file, 0 if the peer closed the
+ * connection before any, or -1 in case of error. A write that fails is
+ * an error even after a part of the data is in the file, errno is the
+ * one of the write. A non-blocking socket returns after one write
+ */
+ssize_t
+microtcp_recvfile (microtcp_sock_t *socket, int fd, off_t offset, size_t count, int flags);
+
+/**
+ * @return an empty set of sockets for microtcp_poll() or NULL on failure
+ */
+microtcp_loop_t *
+microtcp_loop_create (void);
+
+/**
+ * Adds a socket to the set or changes the events it waits for. The
+ * connections of a listener are served only while the listener is in
+ * the set too. The set keeps a pointer to the socket, so the socket
+ * must not move until it is removed.
+ *
+ * @param loop the set
+ * @param socket an established connection or a listener
+ * @param events the MICROTCP_POLLIN and MICROTCP_POLLOUT events to report,
+ * MICROTCP_POLLHUP is always reported
+ * @param data returned with the events of the socket
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_loop_add (microtcp_loop_t *loop, microtcp_sock_t *socket, uint32_t events, void *data);
+
+/**
+ * Removes a socket from the set. It has to be called before the socket
+ * is closed.
+ *
+ * @return 0 on success or -1 if the socket is not in the set
+ */
+int
+microtcp_loop_del (microtcp_loop_t *loop, microtcp_sock_t *socket);
+
+/**
+ * Waits for events on the sockets of the set, as epoll_wait(). While it
+ * waits it receives the segments of every socket, ACKs their data and
+ * runs their retransmission and persist timers, so the transfers of
+ * non-blocking sockets make progress only while some thread polls.
+ * The events are level triggered.
+ *
+ * @param loop the set
+ * @param events array to store the sockets with pending events
+ * @param maxevents the size of the array
+ * @param timeout_ms how long to wait if no event is pending, -1 for ever
+ * @return the number of sockets stored in events (0 on timeout) or -1
+ * on failure
+ */
+int
+microtcp_poll (microtcp_loop_t *loop, microtcp_event_t *events, int maxevents, int timeout_ms);
+
+/**
+ * Frees the set. The sockets in it are not closed.
+ */
+void
+microtcp_loop_free (microtcp_loop_t *loop);
+
+/**
+ * Sets the size of the receive buffer. It has to be called before
+ * microtcp_connect() or microtcp_accept(). New sockets start with
+ * MICROTCP_RECVBUF_LEN bytes and autotuning on.
+ *
+ * @param socket the socket structure
+ * @param len the size in bytes, rounded up to a power of two
+ * @param autotune if not 0 the buffer grows, up to MICROTCP_RECVBUF_MAX,
+ * while the application drains more than half of it per round trip
+ * @return 0 on success or -1 if the connection is already established or
+ * len is larger than MICROTCP_RECVBUF_MAX
+ */
+int
+microtcp_set_recvbuf (microtcp_sock_t *socket, size_t len, int autotune);
+
+/**
+ * Turns the UDP segmentation offloads on or off. With them on,
+ * microtcp_send() hands the kernel runs of full segments as a single
+ * buffer (UDP_SEGMENT) and microtcp_recv() splits the buffers the kernel
+ * coalesced (UDP_GRO) back into segments. New sockets have them on and
+ * they turn off by themselves where the kernel does not support them.
+ *
+ * @param socket the socket structure
+ * @param enable 1 to turn them on, 0 to turn them off
+ * @return 0 on success or -1 if the kernel does not support them
+ */
+int
+microtcp_set_offload (microtcp_sock_t *socket, int enable);
+
+/**
+ * Selects the congestion control algorithm of the socket. It can be
+ * called before or after the connection is established. New sockets
+ * use "reno".
+ *
+ * @param socket the socket structure
+ * @param name "reno", "cubic" or "bbr"
+ * @return 0 on success or -1 if there is no algorithm with this name
+ */
+int
+microtcp_set_congestion_control (microtcp_sock_t *socket, const char *name);
+
+/**
+ * Turns pacing on or off. With it on, microtcp_send() spreads the
+ * segments of the window over the round trip instead of sending them
+ * back to back, at the pacing rate of the congestion control algorithm
+ * if it has one ("bbr") and at the cwnd over the smoothed RTT otherwise.
+ * Up to MICROTCP_PACING_BURST_US of sending time is saved up while the
+ * socket has nothing to send. New sockets have it off.
+ *
+ * @param socket the socket structure
+ * @param enable 1 to turn it on, 0 to turn it off
+ * @return 0
+ */
+int
+microtcp_set_pacing (microtcp_sock_t *socket, int enable);
+
+/**
+ * Bounds how long a blocking microtcp_connect(), microtcp_accept(),
+ * microtcp_send() or microtcp_recv() waits for the peer. A handshake or
+ * a receive that gets no segment for that long fails with EAGAIN, a send
+ * whose data is not ACKed any further for that long fails with
+ * ETIMEDOUT. The connections a listener accepts take its timeout. New
+ * sockets wait for ever.
+ *
+ * @param socket the socket structure
+ * @param timeout_us the timeout in microseconds, 0 to wait for ever
+ * @return 0
+ */
+int
+microtcp_set_timeout (microtcp_sock_t *socket, uint64_t timeout_us);
+
 #endif /* LIB_MICROTCP_H_ */
 
 /*our functions*/
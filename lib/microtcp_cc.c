@@ -0,0 +1,409 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "microtcp_cc.h"
+#include <math.h>
+#include <time.h>
+
+/*every algorithm keeps its state in the cc_priv area of the socket*/
+#define CC_PRIV(socket, type) ((type *)(socket)->cc_priv)
+#define CC_PRIV_CHECK(type) \
+  typedef char type##_fits_in_cc_priv[sizeof(type) <= sizeof(((microtcp_sock_t *)0)->cc_priv) ? 1 : -1]
+
+static uint64_t
+cc_now_us (void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*ssthresh after a loss: half of what was in flight, but not less than 2 segments*/
+static size_t
+loss_ssthresh (size_t flight)
+{
+  return MAX(flight / 2, 2 * MICROTCP_MSS);
+}
+
+/*
+ * Reno (RFC 5681)
+ */
+
+typedef struct
+{
+  size_t bytes_acked;           /*ACKed bytes in congestion avoidance that did not grow the cwnd yet*/
+} reno_t;
+CC_PRIV_CHECK(reno_t);
+
+static void
+reno_init (microtcp_sock_t *socket)
+{
+  socket->cwnd = MICROTCP_INIT_CWND;
+  socket->ssthresh = MICROTCP_INIT_SSTHRESH;
+  CC_PRIV(socket, reno_t)->bytes_acked = 0;
+}
+
+/*slow start with appropriate byte counting (RFC 3465), at most 2 segments for every ACK*/
+static void
+slow_start (microtcp_sock_t *socket, size_t acked)
+{
+  socket->cwnd += MIN(acked, 2 * MICROTCP_MSS);
+}
+
+static void
+reno_on_ack (microtcp_sock_t *socket, size_t acked)
+{
+  reno_t *reno = CC_PRIV(socket, reno_t);
+
+  /*the window does not grow while we repair a loss*/
+  if (microtcp_cc_in_recovery(socket)) return;
+
+  if (socket->cwnd < socket->ssthresh) {
+    slow_start(socket, acked);
+    return;
+  }
+
+  /*congestion avoidance, one MSS for every cwnd bytes ACKed*/
+  reno->bytes_acked += acked;
+  if (reno->bytes_acked >= socket->cwnd) {
+    reno->bytes_acked -= socket->cwnd;
+    socket->cwnd += MICROTCP_MSS;
+  }
+}
+
+static void
+reno_on_loss (microtcp_sock_t *socket)
+{
+  socket->ssthresh = loss_ssthresh(microtcp_cc_flight_size(socket));
+  socket->cwnd = socket->ssthresh;
+  CC_PRIV(socket, reno_t)->bytes_acked = 0;
+}
+
+static void
+reno_on_timeout (microtcp_sock_t *socket)
+{
+  socket->ssthresh = loss_ssthresh(microtcp_cc_flight_size(socket));
+  socket->cwnd = MICROTCP_MSS;
+  CC_PRIV(socket, reno_t)->bytes_acked = 0;
+}
+
+static uint64_t
+no_pacing_rate (microtcp_sock_t *socket)
+{
+  (void) socket;
+  return 0;
+}
+
+const microtcp_cc_ops_t microtcp_cc_reno = {
+  .name = "reno",
+  .init = reno_init,
+  .on_ack = reno_on_ack,
+  .on_loss = reno_on_loss,
+  .on_timeout = reno_on_timeout,
+  .pacing_rate = no_pacing_rate,
+};
+
+/*
+ * CUBIC (RFC 8312). The window is kept in segments while computing the
+ * cubic function and converted back to bytes for the cwnd.
+ */
+
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+typedef struct
+{
+  double w_max;                 /*window in segments just before the last reduction*/
+  double origin;                /*the plateau of the cubic function*/
+  double k;                     /*seconds to reach the plateau again*/
+  double w_est;                 /*the window Reno would have, for the TCP friendly region*/
+  uint64_t epoch_start_us;      /*start of the current congestion avoidance epoch, 0 if none*/
+} cubic_t;
+CC_PRIV_CHECK(cubic_t);
+
+static void
+cubic_init (microtcp_sock_t *socket)
+{
+  socket->cwnd = MICROTCP_INIT_CWND;
+  socket->ssthresh = MICROTCP_INIT_SSTHRESH;
+  memset(CC_PRIV(socket, cubic_t), 0, sizeof(cubic_t));
+}
+
+static void
+cubic_on_ack (microtcp_sock_t *socket, size_t acked)
+{
+  cubic_t *cubic = CC_PRIV(socket, cubic_t);
+  uint64_t now;
+  double cwnd, acked_seg, t, target;
+
+  if (microtcp_cc_in_recovery(socket)) return;
+
+  if (socket->cwnd < socket->ssthresh) {
+    slow_start(socket, acked);
+    return;
+  }
+
+  now = cc_now_us();
+  cwnd = (double)socket->cwnd / MICROTCP_MSS;
+  acked_seg = (double)acked / MICROTCP_MSS;
+
+  if (cubic->epoch_start_us == 0) {
+    cubic->epoch_start_us = now;
+    cubic->origin = MAX(cubic->w_max, cwnd);
+    cubic->k = cbrt((cubic->origin - cwnd) / CUBIC_C);
+    cubic->w_est = cwnd;
+  }
+
+  /*where the cubic function will be one RTT from now*/
+  t = (double)(now - cubic->epoch_start_us + socket->srtt_us) / 1e6;
+  target = CUBIC_C * (t - cubic->k) * (t - cubic->k) * (t - cubic->k) + cubic->origin;
+  if (target > 1.5 * cwnd) target = 1.5 * cwnd;
+
+  /*never grow slower than Reno*/
+  cubic->w_est += 3.0 * (1.0 - CUBIC_BETA) / (1.0 + CUBIC_BETA) * acked_seg / cwnd;
+  if (target < cubic->w_est) target = cubic->w_est;
+
+  if (target > cwnd) socket->cwnd += (size_t)((target - cwnd) / cwnd * acked);
+}
+
+static void
+cubic_reduce (microtcp_sock_t *socket)
+{
+  cubic_t *cubic = CC_PRIV(socket, cubic_t);
+  double cwnd = (double)socket->cwnd / MICROTCP_MSS;
+
+  /*fast convergence: release bandwidth if the window keeps shrinking*/
+  if (cwnd < cubic->w_max) cubic->w_max = cwnd * (1.0 + CUBIC_BETA) / 2.0;
+  else cubic->w_max = cwnd;
+
+  cubic->epoch_start_us = 0;
+  socket->ssthresh = MAX((size_t)(socket->cwnd * CUBIC_BETA), 2 * MICROTCP_MSS);
+}
+
+static void
+cubic_on_loss (microtcp_sock_t *socket)
+{
+  cubic_reduce(socket);
+  socket->cwnd = socket->ssthresh;
+}
+
+static void
+cubic_on_timeout (microtcp_sock_t *socket)
+{
+  cubic_reduce(socket);
+  socket->cwnd = MICROTCP_MSS;
+}
+
+const microtcp_cc_ops_t microtcp_cc_cubic = {
+  .name = "cubic",
+  .init = cubic_init,
+  .on_ack = cubic_on_ack,
+  .on_loss = cubic_on_loss,
+  .on_timeout = cubic_on_timeout,
+  .pacing_rate = no_pacing_rate,
+};
+
+/*
+ * A BBR-like model based controller. It estimates the bottleneck
+ * bandwidth as the maximum delivery rate of the last rounds and the
+ * propagation delay as the minimum RTT, and sizes the cwnd and the
+ * pacing rate from their product instead of reacting to losses.
+ *
+ * A round lasts one smoothed RTT and its delivery rate is the bytes
+ * ACKed in it over its duration.
+ */
+
+#define BBR_BW_ROUNDS 10
+#define BBR_MIN_RTT_WIN_US 10000000
+#define BBR_UNIT 1000
+#define BBR_HIGH_GAIN 2885              /*2/ln(2), fills the pipe in startup*/
+#define BBR_DRAIN_GAIN (BBR_UNIT * BBR_UNIT / BBR_HIGH_GAIN)
+#define BBR_CWND_GAIN 2000
+#define BBR_MIN_CWND (4 * MICROTCP_MSS)
+
+typedef enum
+{
+  BBR_STARTUP,
+  BBR_DRAIN,
+  BBR_PROBE_BW
+} bbr_mode_t;
+
+static const uint32_t bbr_pacing_gain_cycle[] = { 1250, 750, 1000, 1000, 1000, 1000, 1000, 1000 };
+
+typedef struct
+{
+  uint64_t bw[BBR_BW_ROUNDS];   /*delivery rate of the last rounds in bytes per second*/
+  uint64_t min_rtt_us;
+  uint64_t min_rtt_stamp_us;
+  uint64_t round_start_us;
+  uint64_t round_delivered;
+  uint64_t full_bw;             /*the bandwidth startup last grew to*/
+  uint32_t round_count;
+  uint8_t full_bw_rounds;       /*rounds without the bandwidth growing by 25%*/
+  uint8_t mode;
+  uint8_t cycle_idx;
+} bbr_t;
+CC_PRIV_CHECK(bbr_t);
+
+static void
+bbr_init (microtcp_sock_t *socket)
+{
+  socket->cwnd = MICROTCP_INIT_CWND;
+  socket->ssthresh = MICROTCP_INIT_SSTHRESH;
+  memset(CC_PRIV(socket, bbr_t), 0, sizeof(bbr_t));
+}
+
+static uint64_t
+bbr_max_bw (bbr_t *bbr)
+{
+  uint64_t bw = 0;
+
+  for (int i = 0; i < BBR_BW_ROUNDS; i++) bw = MAX(bw, bbr->bw[i]);
+  return bw;
+}
+
+static uint32_t
+bbr_pacing_gain (bbr_t *bbr)
+{
+  switch (bbr->mode) {
+  case BBR_STARTUP: return BBR_HIGH_GAIN;
+  case BBR_DRAIN: return BBR_DRAIN_GAIN;
+  default: return bbr_pacing_gain_cycle[bbr->cycle_idx];
+  }
+}
+
+/*bandwidth-delay product in bytes*/
+static uint64_t
+bbr_bdp (bbr_t *bbr)
+{
+  return bbr_max_bw(bbr) * bbr->min_rtt_us / 1000000;
+}
+
+/*a round is over, keep its delivery rate and move the state machine*/
+static void
+bbr_end_round (microtcp_sock_t *socket, bbr_t *bbr, uint64_t now)
+{
+  uint64_t bw;
+
+  bbr->bw[bbr->round_count % BBR_BW_ROUNDS] = bbr->round_delivered * 1000000 / (now - bbr->round_start_us);
+  bbr->round_count++;
+  bbr->round_start_us = now;
+  bbr->round_delivered = 0;
+  bw = bbr_max_bw(bbr);
+
+  switch (bbr->mode) {
+  case BBR_STARTUP:
+    /*the pipe is full when the bandwidth stops growing for 3 rounds*/
+    if (bw >= bbr->full_bw * 5 / 4) {
+      bbr->full_bw = bw;
+      bbr->full_bw_rounds = 0;
+    } else if (++bbr->full_bw_rounds >= 3) {
+      bbr->mode = BBR_DRAIN;
+    }
+    break;
+  case BBR_DRAIN:
+    /*drain the queue startup created*/
+    if (microtcp_cc_flight_size(socket) <= bbr_bdp(bbr)) {
+      bbr->mode = BBR_PROBE_BW;
+      bbr->cycle_idx = bbr->round_count % (sizeof(bbr_pacing_gain_cycle) / sizeof(bbr_pacing_gain_cycle[0]));
+    }
+    break;
+  default:
+    bbr->cycle_idx = (bbr->cycle_idx + 1) % (sizeof(bbr_pacing_gain_cycle) / sizeof(bbr_pacing_gain_cycle[0]));
+    break;
+  }
+}
+
+static void
+bbr_on_ack (microtcp_sock_t *socket, size_t acked)
+{
+  bbr_t *bbr = CC_PRIV(socket, bbr_t);
+  uint64_t now = cc_now_us();
+  uint64_t round_len;
+  uint64_t target;
+
+  /*the minimum RTT expires so that a route change is noticed*/
+  if (socket->latest_rtt_us != 0
+      && (bbr->min_rtt_us == 0 || socket->latest_rtt_us <= bbr->min_rtt_us
+          || now - bbr->min_rtt_stamp_us > BBR_MIN_RTT_WIN_US)) {
+    bbr->min_rtt_us = socket->latest_rtt_us;
+    bbr->min_rtt_stamp_us = now;
+  }
+
+  if (bbr->round_start_us == 0) bbr->round_start_us = now;
+  bbr->round_delivered += acked;
+
+  round_len = MAX(socket->srtt_us, MICROTCP_MIN_RTO_US / 2);
+  if (now - bbr->round_start_us >= round_len) bbr_end_round(socket, bbr, now);
+
+  if (bbr_max_bw(bbr) == 0 || bbr->min_rtt_us == 0) {
+    /*no model yet, grow like slow start*/
+    socket->cwnd += acked;
+    return;
+  }
+
+  target = bbr_bdp(bbr) * (bbr->mode == BBR_STARTUP ? BBR_HIGH_GAIN : BBR_CWND_GAIN) / BBR_UNIT;
+  target = MAX(target, BBR_MIN_CWND);
+
+  /*grow towards the target as the ACKs arrive, shrink to it at once*/
+  socket->cwnd = MIN(socket->cwnd + acked, target);
+}
+
+static void
+bbr_on_loss (microtcp_sock_t *socket)
+{
+  /*the model does not change because of a loss, just do not burst while repairing it*/
+  socket->cwnd = MAX(microtcp_cc_flight_size(socket), BBR_MIN_CWND);
+}
+
+static void
+bbr_on_timeout (microtcp_sock_t *socket)
+{
+  socket->cwnd = MICROTCP_MSS;
+}
+
+static uint64_t
+bbr_pacing_rate (microtcp_sock_t *socket)
+{
+  bbr_t *bbr = CC_PRIV(socket, bbr_t);
+
+  return bbr_max_bw(bbr) * bbr_pacing_gain(bbr) / BBR_UNIT;
+}
+
+const microtcp_cc_ops_t microtcp_cc_bbr = {
+  .name = "bbr",
+  .init = bbr_init,
+  .on_ack = bbr_on_ack,
+  .on_loss = bbr_on_loss,
+  .on_timeout = bbr_on_timeout,
+  .pacing_rate = bbr_pacing_rate,
+};
+
+const microtcp_cc_ops_t *
+microtcp_cc_find (const char *name)
+{
+  static const microtcp_cc_ops_t *all[] = { &microtcp_cc_reno, &microtcp_cc_cubic, &microtcp_cc_bbr };
+
+  for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); i++) {
+    if (strcmp(all[i]->name, name) == 0) return all[i];
+  }
+  return NULL;
+}
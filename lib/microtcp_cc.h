@@ -0,0 +1,92 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIB_MICROTCP_CC_H_
+#define LIB_MICROTCP_CC_H_
+
+#include "microtcp.h"
+
+/**
+ * A congestion control algorithm. Every microTCP socket points to one of
+ * them and the send path calls its hooks. The algorithm keeps its own
+ * state in the cc_priv area of the socket and controls the cwnd and
+ * ssthresh fields.
+ */
+typedef struct microtcp_cc_ops
+{
+  const char *name;
+
+  /**
+   * Called when the connection is established or the algorithm is
+   * selected on an established connection.
+   */
+  void (*init) (microtcp_sock_t *socket);
+
+  /**
+   * Called for every ACK that moves snd_una forward.
+   *
+   * @param socket the socket structure
+   * @param acked the number of bytes the ACK covered
+   */
+  void (*on_ack) (microtcp_sock_t *socket, size_t acked);
+
+  /**
+   * Called when three duplicate ACKs start a fast retransmit.
+   */
+  void (*on_loss) (microtcp_sock_t *socket);
+
+  /**
+   * Called when the retransmission timer expires.
+   */
+  void (*on_timeout) (microtcp_sock_t *socket);
+
+  /**
+   * @return the rate in bytes per second at which the segments should
+   * leave, or 0 if the algorithm has no opinion.
+   */
+  uint64_t (*pacing_rate) (microtcp_sock_t *socket);
+} microtcp_cc_ops_t;
+
+extern const microtcp_cc_ops_t microtcp_cc_reno;
+extern const microtcp_cc_ops_t microtcp_cc_cubic;
+extern const microtcp_cc_ops_t microtcp_cc_bbr;
+
+/**
+ * @param name the name of the algorithm ("reno", "cubic" or "bbr")
+ * @return the algorithm or NULL if there is none with this name
+ */
+const microtcp_cc_ops_t *
+microtcp_cc_find (const char *name);
+
+/*bytes sent but not ACKed yet*/
+static inline size_t
+microtcp_cc_flight_size (const microtcp_sock_t *socket)
+{
+  return (uint32_t)(socket->seq_number - socket->snd_una);
+}
+
+/*true while the sender repairs a loss, until everything sent before it is ACKed*/
+static inline int
+microtcp_cc_in_recovery (const microtcp_sock_t *socket)
+{
+  return SEQ_LT(socket->snd_una, socket->recover);
+}
+
+#endif /* LIB_MICROTCP_CC_H_ */
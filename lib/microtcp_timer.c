@@ -0,0 +1,170 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "microtcp_timer.h"
+#include <string.h>
+
+#define WHEEL_MASK (MICROTCP_WHEEL_SLOTS - 1)
+#define WHEEL_SPAN(level) (1ULL << (MICROTCP_WHEEL_BITS * (level)))  /*ticks one slot of the level spans*/
+
+static void
+timer_link (microtcp_timer_t **head, microtcp_timer_t *timer)
+{
+  timer->next = *head;
+  if (*head != NULL) (*head)->pprev = &timer->next;
+  *head = timer;
+  timer->pprev = head;
+}
+
+static void
+timer_unlink (microtcp_timer_t *timer)
+{
+  *timer->pprev = timer->next;
+  if (timer->next != NULL) timer->next->pprev = timer->pprev;
+  timer->next = NULL;
+  timer->pprev = NULL;
+}
+
+/*puts the timer in the slot of the lowest level that reaches its expiration, not before the tick first.
+ *the slots of the tick the wheel is at are done, except while the upper levels move down into them*/
+static void
+wheel_insert (microtcp_wheel_t *wheel, microtcp_timer_t *timer, uint64_t first)
+{
+  uint64_t expires = (timer->expires_us + MICROTCP_WHEEL_TICK_US - 1) / MICROTCP_WHEEL_TICK_US;
+  int level = 0;
+
+  /*a timer that is due expires with the first tick, one too far away expires early and the wheel arms it again*/
+  if (expires < first) expires = first;
+  if (expires - wheel->tick >= WHEEL_SPAN(MICROTCP_WHEEL_LEVELS)) expires = wheel->tick + WHEEL_SPAN(MICROTCP_WHEEL_LEVELS) - 1;
+
+  while (level < MICROTCP_WHEEL_LEVELS - 1 && expires - wheel->tick >= WHEEL_SPAN(level + 1)) level++;
+
+  timer_link(&wheel->slots[level][(expires >> (MICROTCP_WHEEL_BITS * level)) & WHEEL_MASK], timer);
+  timer->wheel = wheel;
+  timer->level = level;
+  wheel->count[level]++;
+}
+
+void
+microtcp_wheel_init (microtcp_wheel_t *wheel, uint64_t now_us)
+{
+  memset(wheel, 0, sizeof(*wheel));
+  wheel->tick = now_us / MICROTCP_WHEEL_TICK_US;
+}
+
+void
+microtcp_timer_cancel (microtcp_timer_t *timer)
+{
+  if (timer->pprev == NULL) return;
+
+  if (timer->level >= 0) timer->wheel->count[timer->level]--;
+  timer_unlink(timer);
+}
+
+void
+microtcp_timer_arm (microtcp_wheel_t *wheel, microtcp_timer_t *timer, uint64_t expires_us)
+{
+  microtcp_timer_cancel(timer);
+  timer->expires_us = expires_us;
+  wheel_insert(wheel, timer, wheel->tick + 1);
+}
+
+static int
+wheel_empty (const microtcp_wheel_t *wheel)
+{
+  for (int level = 0; level < MICROTCP_WHEEL_LEVELS; level++) {
+    if (wheel->count[level] > 0) return 0;
+  }
+  return 1;
+}
+
+void
+microtcp_wheel_expire (microtcp_wheel_t *wheel, uint64_t now_us, microtcp_timer_t **expired)
+{
+  uint64_t now = now_us / MICROTCP_WHEEL_TICK_US;
+  microtcp_timer_t *timer, *slot;
+  uint64_t t;
+
+  while (wheel->tick < now) {
+    if (wheel_empty(wheel)) {
+      wheel->tick = now;
+      break;
+    }
+    /*with level 0 empty nothing happens until the next level moves down, at the end of the round of level 0*/
+    if (wheel->count[0] == 0) {
+      if ((wheel->tick | WHEEL_MASK) >= now) {
+        wheel->tick = now;
+        break;
+      }
+      wheel->tick |= WHEEL_MASK;
+    }
+
+    t = ++wheel->tick;
+
+    /*the slots of the upper levels that start at this tick move down*/
+    for (int level = 1; level < MICROTCP_WHEEL_LEVELS && (t & (WHEEL_SPAN(level) - 1)) == 0; level++) {
+      slot = wheel->slots[level][(t >> (MICROTCP_WHEEL_BITS * level)) & WHEEL_MASK];
+      wheel->slots[level][(t >> (MICROTCP_WHEEL_BITS * level)) & WHEEL_MASK] = NULL;
+      while ((timer = slot) != NULL) {
+        slot = timer->next;
+        wheel->count[level]--;
+        wheel_insert(wheel, timer, t);
+      }
+    }
+
+    slot = wheel->slots[0][t & WHEEL_MASK];
+    wheel->slots[0][t & WHEEL_MASK] = NULL;
+    while ((timer = slot) != NULL) {
+      slot = timer->next;
+      wheel->count[0]--;
+      if (timer->expires_us > now_us) {
+        /*it was further away than the wheel reaches*/
+        wheel_insert(wheel, timer, t + 1);
+        continue;
+      }
+      timer_link(expired, timer);
+      timer->level = -1;
+    }
+  }
+}
+
+uint64_t
+microtcp_wheel_next (const microtcp_wheel_t *wheel)
+{
+  uint64_t next = 0;
+  uint64_t block;
+
+  for (int level = 0; level < MICROTCP_WHEEL_LEVELS; level++) {
+    if (wheel->count[level] == 0) continue;
+
+    /*the first slot of the level that is not empty, for the upper levels the tick it moves down at*/
+    block = wheel->tick >> (MICROTCP_WHEEL_BITS * level);
+    for (int k = 1; k <= MICROTCP_WHEEL_SLOTS; k++) {
+      if (wheel->slots[level][(block + k) & WHEEL_MASK] != NULL) {
+        uint64_t at = ((block + k) << (MICROTCP_WHEEL_BITS * level)) * MICROTCP_WHEEL_TICK_US;
+
+        if (next == 0 || at < next) next = at;
+        break;
+      }
+    }
+  }
+
+  return next;
+}
@@ -0,0 +1,105 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIB_MICROTCP_TIMER_H_
+#define LIB_MICROTCP_TIMER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MICROTCP_WHEEL_TICK_US 256  /* The resolution of the timers */
+#define MICROTCP_WHEEL_BITS 6
+#define MICROTCP_WHEEL_SLOTS (1 << MICROTCP_WHEEL_BITS)
+#define MICROTCP_WHEEL_LEVELS 4     /* Timers up to 64^4 ticks, more than an hour, ahead */
+
+/**
+ * A timer of a wheel. It is a member of the structure it serves, the
+ * wheel only links it in its slots, so arming and cancelling it never
+ * allocates.
+ */
+typedef struct microtcp_timer
+{
+  struct microtcp_timer *next;
+  struct microtcp_timer **pprev;   /**< NULL while the timer is not armed */
+  struct microtcp_wheel *wheel;
+  int level;                       /**< The level of its slot, -1 in an expired list */
+  uint64_t expires_us;
+  void *owner;                     /**< Whoever handles the timer when it expires */
+  int kind;                        /**< Which of the timers of the owner it is */
+} microtcp_timer_t;
+
+/**
+ * A hierarchical timing wheel. Level 0 has a slot per tick, every slot
+ * of the next level spans all the slots of the previous one. A timer
+ * goes in the level its distance falls in and moves down a level each
+ * time the wheel reaches its slot, so arming and cancelling are O(1)
+ * and advancing costs O(1) per tick and timer.
+ */
+typedef struct microtcp_wheel
+{
+  microtcp_timer_t *slots[MICROTCP_WHEEL_LEVELS][MICROTCP_WHEEL_SLOTS];
+  int count[MICROTCP_WHEEL_LEVELS];
+  uint64_t tick;                   /**< The timers of this tick and before have expired */
+} microtcp_wheel_t;
+
+/**
+ * @param now_us the current time, in the clock the timers use
+ */
+void
+microtcp_wheel_init (microtcp_wheel_t *wheel, uint64_t now_us);
+
+/**
+ * Arms the timer to expire at expires_us, or re-arms it if it is armed
+ * already, in this wheel or in another one.
+ */
+void
+microtcp_timer_arm (microtcp_wheel_t *wheel, microtcp_timer_t *timer, uint64_t expires_us);
+
+/**
+ * Disarms the timer. It does nothing if the timer is not armed.
+ */
+void
+microtcp_timer_cancel (microtcp_timer_t *timer);
+
+static inline int
+microtcp_timer_armed (const microtcp_timer_t *timer)
+{
+  return timer->pprev != NULL;
+}
+
+/**
+ * Advances the wheel to now_us and takes the timers that expired out of
+ * it. They stay armed, linked in the expired list, until the caller
+ * cancels them or arms them again, so a timer of the list that another
+ * handler cancels first just leaves the list.
+ *
+ * @param expired the head of the list to store the expired timers
+ */
+void
+microtcp_wheel_expire (microtcp_wheel_t *wheel, uint64_t now_us, microtcp_timer_t **expired);
+
+/**
+ * @return a time no later than the next expiration, when
+ * microtcp_wheel_expire() has to run, or 0 if the wheel is empty
+ */
+uint64_t
+microtcp_wheel_next (const microtcp_wheel_t *wheel);
+
+#endif /* LIB_MICROTCP_TIMER_H_ */
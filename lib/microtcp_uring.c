@@ -0,0 +1,381 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE  /*struct mmsghdr*/
+#include "microtcp_uring.h"
+#include "microtcp.h"
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+/*the user_data of the requests that are not receives, the receives carry their slot*/
+#define URING_SEND_TAG (1ULL << 32)
+#define URING_CANCEL_TAG (2ULL << 32)
+
+/*how long microtcp_uring_free() waits for the cancelled receives*/
+#define URING_CANCEL_TIMEOUT_US 1000000
+
+struct microtcp_uring
+{
+  int fd;
+  int sd;
+
+  /*submission queue*/
+  void *sq_ring;
+  size_t sq_ring_len;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+  unsigned sq_local_tail;       /*the tail we have filled up to, the kernel sees it at the next submission*/
+
+  /*completion queue, in the mapping of the submission queue if the kernel has IORING_FEAT_SINGLE_MMAP*/
+  void *cq_ring;
+  size_t cq_ring_len;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  int recvs_posted;
+  int sends_inflight;
+  struct mmsghdr *send_msgs;    /*the batch of microtcp_uring_sendmsgs(), the sends carry their index in it*/
+  int send_failed;              /*the first datagram of the batch that failed, -1 if none*/
+  int send_errno;
+
+  /*receives that completed but were not returned yet, a circular queue*/
+  uint32_t *done_slot;
+  int32_t *done_res;
+  int done_max;
+  int done_head;
+  int done_count;
+};
+
+static int
+uring_enter (struct microtcp_uring *ring, unsigned to_submit, unsigned min_complete, uint64_t timeout_us)
+{
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned flags = IORING_ENTER_EXT_ARG;
+  int ret;
+
+  memset(&arg, 0, sizeof(arg));
+  if (min_complete > 0) {
+    flags |= IORING_ENTER_GETEVENTS;
+    if (timeout_us != 0) {
+      ts.tv_sec = timeout_us / 1000000;
+      ts.tv_nsec = (timeout_us % 1000000) * 1000;
+      arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+  }
+
+  ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, flags, &arg, sizeof(arg));
+  if (ret == -1 && errno == ETIME) errno = EAGAIN;
+  return ret;
+}
+
+/*hands the requests we filled in to the kernel and, if min_complete is not 0, waits for completions*/
+static int
+uring_submit (struct microtcp_uring *ring, unsigned min_complete, uint64_t timeout_us)
+{
+  /*what the kernel has not consumed of an earlier call goes in too*/
+  unsigned to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+  __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+  if (to_submit == 0 && min_complete == 0) return 0;
+
+  return uring_enter(ring, to_submit, min_complete, timeout_us);
+}
+
+/*takes every completion out of the queue. the receives wait in the done queue, the sends are only counted*/
+static void
+uring_reap (struct microtcp_uring *ring)
+{
+  unsigned head = *ring->cq_head;
+  unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  struct io_uring_cqe *cqe;
+  int idx;
+
+  for (; head != tail; head++) {
+    cqe = &ring->cqes[head & ring->cq_mask];
+
+    if (cqe->user_data & URING_SEND_TAG) {
+      /*the sends are not linked, they complete in any order*/
+      idx = (uint32_t)cqe->user_data;
+      ring->sends_inflight--;
+      if (cqe->res >= 0) {
+        ring->send_msgs[idx].msg_len = cqe->res;
+      } else if (ring->send_failed == -1 || idx < ring->send_failed) {
+        ring->send_failed = idx;
+        ring->send_errno = -cqe->res;
+      }
+    } else if (!(cqe->user_data & URING_CANCEL_TAG)) {
+      ring->recvs_posted--;
+      idx = (ring->done_head + ring->done_count) % ring->done_max;
+      ring->done_slot[idx] = (uint32_t)cqe->user_data;
+      ring->done_res[idx] = cqe->res;
+      ring->done_count++;
+    }
+  }
+
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*the next free entry of the submission queue, NULL if the kernel has not consumed enough of them yet*/
+static struct io_uring_sqe *
+uring_get_sqe (struct microtcp_uring *ring)
+{
+  struct io_uring_sqe *sqe;
+  unsigned idx;
+
+  if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+    if (uring_submit(ring, 0, 0) == -1) return NULL;
+    if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) return NULL;
+  }
+
+  idx = ring->sq_local_tail & ring->sq_mask;
+  ring->sq_array[idx] = idx;
+  ring->sq_local_tail++;
+
+  sqe = &ring->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+struct microtcp_uring *
+microtcp_uring_create (int sd, int slots)
+{
+  struct io_uring_params params;
+  struct microtcp_uring *ring;
+  uint8_t *sq;
+
+  ring = calloc(1, sizeof(struct microtcp_uring));
+  if (ring == NULL) return NULL;
+  ring->sd = sd;
+  ring->send_failed = -1;
+
+  ring->done_max = slots;
+  ring->done_slot = calloc(slots, sizeof(uint32_t));
+  ring->done_res = calloc(slots, sizeof(int32_t));
+
+  /*room for every receive and a full send batch*/
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CLAMP;
+  ring->fd = syscall(__NR_io_uring_setup, slots + MICROTCP_BATCH, &params);
+  if (ring->done_slot == NULL || ring->done_res == NULL || ring->fd == -1) {
+    free(ring->done_slot);
+    free(ring->done_res);
+    if (ring->fd >= 0) close(ring->fd);
+    free(ring);
+    return NULL;
+  }
+
+  /*the waits need timeouts, which need IORING_ENTER_EXT_ARG*/
+  if (!(params.features & IORING_FEAT_EXT_ARG) || params.sq_entries < (unsigned)(slots + MICROTCP_BATCH)) {
+    close(ring->fd);
+    free(ring->done_slot);
+    free(ring->done_res);
+    free(ring);
+    return NULL;
+  }
+
+  ring->sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) ring->sq_ring_len = ring->cq_ring_len = MAX(ring->sq_ring_len, ring->cq_ring_len);
+  ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP) ? ring->sq_ring
+                  : mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    if (ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_len);
+    if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_len);
+    if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_len);
+    close(ring->fd);
+    free(ring->done_slot);
+    free(ring->done_res);
+    free(ring);
+    return NULL;
+  }
+
+  sq = ring->sq_ring;
+  ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_entries = params.sq_entries;
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->sq_local_tail = *ring->sq_tail;
+
+  ring->cq_head = (unsigned *)((uint8_t *)ring->cq_ring + params.cq_off.head);
+  ring->cq_tail = (unsigned *)((uint8_t *)ring->cq_ring + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *)((uint8_t *)ring->cq_ring + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)((uint8_t *)ring->cq_ring + params.cq_off.cqes);
+
+  return ring;
+}
+
+void
+microtcp_uring_free (struct microtcp_uring *ring)
+{
+  struct io_uring_sqe *sqe;
+  uint64_t waited = 0;
+  struct timespec start, now;
+
+  if (ring == NULL) return;
+
+  /*the kernel must be done with the buffers of the receives before the caller frees them*/
+  if (ring->recvs_posted > 0 && (sqe = uring_get_sqe(ring)) != NULL) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = ring->sd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL | IORING_ASYNC_CANCEL_FD;
+    sqe->user_data = URING_CANCEL_TAG;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uring_submit(ring, 0, 0);
+    while (ring->recvs_posted > 0 && waited < URING_CANCEL_TIMEOUT_US) {
+      if (uring_enter(ring, 0, 1, URING_CANCEL_TIMEOUT_US - waited) == -1 && errno != EINTR && errno != EAGAIN) break;
+      uring_reap(ring);
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      waited = (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000;
+    }
+  }
+
+  munmap(ring->sqes, ring->sqes_len);
+  if (ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_len);
+  munmap(ring->sq_ring, ring->sq_ring_len);
+  close(ring->fd);
+  free(ring->done_slot);
+  free(ring->done_res);
+  free(ring);
+}
+
+int
+microtcp_uring_fd (const struct microtcp_uring *ring)
+{
+  return ring->fd;
+}
+
+int
+microtcp_uring_post_recv (struct microtcp_uring *ring, struct msghdr *hdr, uint32_t slot)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+  if (sqe == NULL) return -1;
+
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = ring->sd;
+  sqe->addr = (uint64_t)(uintptr_t)hdr;
+  sqe->len = 1;
+  sqe->user_data = slot;
+  ring->recvs_posted++;
+
+  return 0;
+}
+
+int
+microtcp_uring_recv (struct microtcp_uring *ring, uint32_t *slots, int32_t *res, int max, uint64_t timeout_us,
+                     int dontwait)
+{
+  int n;
+
+  uring_reap(ring);
+  /*the receives that were re-posted go in, with the wait if nothing completed yet*/
+  if (uring_submit(ring, (ring->done_count == 0 && !dontwait) ? 1 : 0, timeout_us) == -1) return -1;
+  uring_reap(ring);
+  if (ring->done_count == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  for (n = 0; n < max && ring->done_count > 0; n++) {
+    slots[n] = ring->done_slot[ring->done_head];
+    res[n] = ring->done_res[ring->done_head];
+    ring->done_head = (ring->done_head + 1) % ring->done_max;
+    ring->done_count--;
+  }
+
+  return n;
+}
+
+int
+microtcp_uring_sendmsgs (struct microtcp_uring *ring, struct mmsghdr *msgs, int n, int flags)
+{
+  struct io_uring_sqe *sqe;
+  unsigned queued;
+
+  ring->send_msgs = msgs;
+  ring->send_failed = -1;
+  for (int i = 0; i < n; i++) {
+    if ((sqe = uring_get_sqe(ring)) == NULL) {
+      /*the ring is full of requests the kernel has not taken, send what is queued and report the rest as not sent*/
+      if (i == 0) return -1;
+      n = i;
+      break;
+    }
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = ring->sd;
+    sqe->addr = (uint64_t)(uintptr_t)&msgs[i].msg_hdr;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    sqe->user_data = URING_SEND_TAG | i;
+    ring->sends_inflight++;
+  }
+
+  if (uring_submit(ring, 0, 0) == -1) {
+    /*the sends the kernel did not consume are the last requests of the queue, take them back and report them as not sent*/
+    queued = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (queued > (unsigned)n) queued = n;
+    ring->sq_local_tail -= queued;
+    ring->sends_inflight -= queued;
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    n -= queued;
+    if (n == 0) return -1;
+  }
+
+  /*the message headers live on the stack of the caller, so we wait for the kernel to be done with every datagram*/
+  while (ring->sends_inflight > 0) {
+    uring_reap(ring);
+    if (ring->sends_inflight == 0) break;
+    if (uring_enter(ring, 0, 1, 0) == -1 && errno != EINTR) return -1;
+  }
+
+  if (ring->send_failed == -1) return n;
+  if (ring->send_failed > 0) return ring->send_failed;
+  errno = ring->send_errno;
+  return -1;
+}
+
+int
+microtcp_uring_submit (struct microtcp_uring *ring)
+{
+  return uring_submit(ring, 0, 0) == -1 ? -1 : 0;
+}
+
+int
+microtcp_uring_pending (const struct microtcp_uring *ring)
+{
+  return ring->done_count > 0 || *ring->cq_head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,108 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIB_MICROTCP_URING_H_
+#define LIB_MICROTCP_URING_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+/**
+ * The io_uring backend of the data path. It keeps a receive posted for
+ * every slot of the receive arena of a socket, so the datagrams land in
+ * the arena without a system call each, and it submits the datagrams
+ * of a send batch with one system call. The ring is driven with the raw
+ * system calls, liburing is not needed.
+ */
+struct microtcp_uring;
+struct mmsghdr;
+
+/**
+ * @param sd the UDP socket the ring serves
+ * @param slots the most receives that are posted at once
+ * @return the ring or NULL if the kernel has no usable io_uring, the
+ * caller then stays with the plain system calls
+ */
+struct microtcp_uring *
+microtcp_uring_create (int sd, int slots);
+
+/**
+ * Cancels the posted receives, waits until the kernel is done with
+ * their buffers and frees the ring.
+ */
+void
+microtcp_uring_free (struct microtcp_uring *ring);
+
+/**
+ * @return the descriptor of the ring, readable when receives completed
+ */
+int
+microtcp_uring_fd (const struct microtcp_uring *ring);
+
+/**
+ * Posts a receive of one datagram in hdr. It is submitted with the next
+ * call that enters the kernel.
+ *
+ * @param slot returned with the completion of the receive
+ */
+int
+microtcp_uring_post_recv (struct microtcp_uring *ring, struct msghdr *hdr, uint32_t slot);
+
+/**
+ * Hands the receives posted so far to the kernel without waiting.
+ */
+int
+microtcp_uring_submit (struct microtcp_uring *ring);
+
+/**
+ * Waits for posted receives to complete.
+ *
+ * @param slots array to store the slots of the completed receives
+ * @param res array to store their results, the length of the datagram
+ * or a negative errno
+ * @param max the size of the arrays
+ * @param timeout_us how long to wait, 0 for ever
+ * @param dontwait if not 0 only the receives that already completed are
+ * returned
+ * @return the number of completed receives or -1 with errno set (EAGAIN
+ * if none completed)
+ */
+int
+microtcp_uring_recv (struct microtcp_uring *ring, uint32_t *slots, int32_t *res, int max, uint64_t timeout_us,
+                     int dontwait);
+
+/**
+ * Sends the datagrams with one system call and waits until the kernel
+ * has taken all of them, as sendmmsg().
+ *
+ * @return the number of datagrams sent before the first that failed or
+ * -1 with errno set if the first failed
+ */
+int
+microtcp_uring_sendmsgs (struct microtcp_uring *ring, struct mmsghdr *msgs, int n, int flags);
+
+/**
+ * @return true if receives completed that microtcp_uring_recv() has not
+ * returned yet, the descriptor of the ring may not be readable for them
+ */
+int
+microtcp_uring_pending (const struct microtcp_uring *ring);
+
+#endif /* LIB_MICROTCP_URING_H_ */
@@ -18,6 +18,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -30,10 +31,17 @@
 #include <stddef.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include "../lib/microtcp.h"
+#include "../lib/microtcp_cc.h"
 
 #define CHUNK_SIZE 4096
 
@@ -161,12 +169,9 @@ server_tcp (uint16_t listen_port, const char *file)
 int
 server_microtcp (uint16_t listen_port, const char *file)
 {
-  uint8_t *buffer;
-  FILE *fp;
+  int fd;
   microtcp_sock_t sock;
   int accepted;
-  int received;
-  ssize_t written;
   ssize_t total_bytes = 0;
   socklen_t client_addr_len;
 
@@ -175,18 +180,10 @@ server_microtcp (uint16_t listen_port, const char *file)
   struct timespec start_time;
   struct timespec end_time;
 
-  /* Allocate memory for the application receive buffer */
-  buffer = (uint8_t *) malloc (CHUNK_SIZE);
-  if (!buffer) {
-    perror ("Allocate application receive buffer\n");
-    return -EXIT_FAILURE;
-  }
-
   /* Open the file for writing the data from the network */
-  fp = fopen (file, "w");
-  if (!fp) {
+  fd = open (file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
     perror ("Open file for writing\n");
-    free (buffer);
     return -EXIT_FAILURE;
   }
 
@@ -200,8 +197,7 @@ server_microtcp (uint16_t listen_port, const char *file)
 
   if (microtcp_bind (&sock, (struct sockaddr *) &sin, sizeof(struct sockaddr_in)) == -1) {
     perror ("microTCP bind\n");
-    free (buffer);
-    fclose (fp);
+    close (fd);
     return -EXIT_FAILURE;
   }
 
@@ -212,8 +208,7 @@ server_microtcp (uint16_t listen_port, const char *file)
   accepted = microtcp_accept (&sock, &client_addr, client_addr_len);
   if (accepted == -1) {
     perror ("microTCP accept\n");
-    free (buffer);
-    fclose (fp);
+    close (fd);
     return -EXIT_FAILURE;
   }
 
@@ -230,18 +225,15 @@ server_microtcp (uint16_t listen_port, const char *file)
    */
 
   clock_gettime (CLOCK_MONOTONIC_RAW, &start_time);
-  while ((received = microtcp_recv (&sock, buffer, CHUNK_SIZE, 0)) == -1) {
-    written = fwrite (buffer, sizeof(uint8_t), received, fp);
-    total_bytes += received;
-    if (written * sizeof(uint8_t) != received) {
-      printf ("Failed to write to the file the"
-              " amount of data received from the network.\n");
-      microtcp_shutdown (&sock, SHUT_RDWR);
-      close (sock.sd);
-      free (buffer);
-      fclose (fp);
-      return -EXIT_FAILURE;
-    }
+  /* The data goes from the receive buffer straight to the file, until the client closes */
+  total_bytes = microtcp_recvfile (&sock, fd, 0, SIZE_MAX, 0);
+  if (total_bytes == -1) {
+    printf ("Failed to write to the file the"
+            " amount of data received from the network.\n");
+    microtcp_shutdown (&sock, SHUT_RDWR);
+    close (sock.sd);
+    close (fd);
+    return -EXIT_FAILURE;
   }
   clock_gettime (CLOCK_MONOTONIC_RAW, &end_time);
   print_statistics (total_bytes, start_time, end_time);
@@ -249,13 +241,11 @@ server_microtcp (uint16_t listen_port, const char *file)
   if(sock.state == CLOSING_BY_PEER){
     microtcp_shutdown (&sock, SHUT_RDWR);
     close (sock.sd);
-    fclose (fp);
-    free (buffer);
+    close (fd);
   } else {
     perror("Error in receiving data\n");
     close (sock.sd);
-    fclose (fp);
-    free (buffer);
+    close (fd);
     exit(EXIT_FAILURE);
   }
 
@@ -349,26 +339,18 @@ client_tcp (const char *serverip, uint16_t server_port, const char *file)
 int
 client_microtcp (const char *serverip, uint16_t server_port, const char *file)
 {
-  uint8_t *buffer;
   microtcp_sock_t sock;
-  socklen_t client_addr_len;
-  FILE *fp;
-  size_t read_items = 0;
+  int fd;
+  struct stat st;
   ssize_t data_sent;
-  struct sockaddr *client_addr;
 
-  /* Allocate memory for the application receive buffer */
-  buffer = (uint8_t *) malloc (CHUNK_SIZE);
-  if (!buffer) {
-    perror ("Allocate application receive buffer");
-    return -EXIT_FAILURE;
-  }
-
-  /* Open the file for writing the data from the network */
-  fp = fopen (file, "r");
-  if (!fp) {
+  /* Open the file for reading the data to send */
+  fd = open (file, O_RDONLY);
+  if (fd == -1 || fstat (fd, &st) == -1) {
     perror ("Open file for reading");
-    free (buffer);
+    if (fd != -1) {
+      close (fd);
+    }
     return -EXIT_FAILURE;
   }
 
@@ -392,41 +374,768 @@ client_microtcp (const char *serverip, uint16_t server_port, const char *file)
   printf("END OF HANDSHAKE\n");
 
   printf ("Starting sending data...\n");
-  /* Start sending the data */
-  int c = 0;
-  while (!feof (fp)) {
-    read_items = fread (buffer, sizeof(uint8_t), CHUNK_SIZE, fp);
-    if (read_items < 1) {
-      perror ("Failed read from file");
-      microtcp_shutdown (&sock, SHUT_RDWR);
-      close (sock.sd);
-      free (buffer);
-      fclose (fp);
-      return -EXIT_FAILURE;
+  /* Send the whole file at once, the window stays full until its end */
+  data_sent = microtcp_sendfile (&sock, fd, 0, st.st_size);
+  if (data_sent != st.st_size) {
+    printf ("Failed to send the"
+            " amount of data read from the file.\n");
+    microtcp_shutdown (&sock, SHUT_RDWR);
+    close (sock.sd);
+    close (fd);
+    return -EXIT_FAILURE;
+  }
+
+  printf ("Data sent. Terminating...\n");
+
+  microtcp_shutdown (&sock, SHUT_RDWR);
+  close (sock.sd);
+  close (fd);
+  return 0;
+}
+
+/*
+ * Benchmark mode (-b). The server and the client of every run are threads
+ * of this process and talk over loopback, so a sweep is reproducible on
+ * one machine. Every combination of the swept values is run a number of
+ * times, with microTCP and then with kernel TCP, and for each we report
+ * the percentiles of the throughput, the percentiles of the round trip of
+ * one small segment (the ping-pong after the bulk transfer), the CPU time
+ * of both sides and the retransmissions of the sender.
+ *
+ * Loss and RTT are emulated for microTCP by a relay thread between the
+ * client and the server, which drops and delays the datagrams. Kernel TCP
+ * cannot pass through it, so it only runs the combinations without
+ * either; netem is the tool for those. The congestion control and the
+ * pacing are swept for microTCP only, kernel TCP keeps its own.
+ */
+
+#define BENCH_MAX_VALUES 16
+#define BENCH_PING_LEN 64
+#define BENCH_CHUNK (1024 * 1024)
+#define BENCH_TIMEOUT_S 10      /* a side that hears nothing from the other for that long fails */
+
+struct bench_config {
+  int tcp;
+  size_t size;
+  size_t window;        /* 0 lets microTCP autotune and the kernel choose */
+  double loss;          /* percent of the datagrams, in each direction */
+  double rtt_ms;
+  const char *cc;       /* the congestion control of microTCP */
+  int pacing;
+};
+
+struct bench_result {
+  struct bench_config config;
+  int reps;             /* the repetitions that completed, only they have figures */
+  int failed;           /* the repetitions that failed */
+  double *throughput;   /* MB/s of each repetition */
+  double *pingpong_us;  /* the round trips of the ping-pongs of all the repetitions */
+  int pings;
+  double client_cpu;    /* percent of the transfer time, mean of the repetitions */
+  double server_cpu;
+  double retransmissions;
+  uint64_t max_retransmissions;
+};
+
+struct bench_server {
+  const struct bench_config *config;
+  int sd;
+  microtcp_sock_t *sock;
+  uint8_t *buffer;
+  int pings;
+  double seconds;
+  double cpu;
+  int error;
+};
+
+struct bench_packet {
+  struct bench_packet *next;
+  uint64_t release_us;
+  size_t len;
+  uint8_t data[];
+};
+
+struct bench_relay {
+  int client_sd;        /* faces the client */
+  int server_sd;        /* connected to the server */
+  struct sockaddr_in client_addr;
+  socklen_t client_addr_len;
+  double loss;
+  uint64_t delay_us;    /* half of the RTT, in each direction */
+  unsigned int seed;
+  volatile int stop;
+  struct bench_packet *head[2];
+  struct bench_packet *tail[2];
+};
+
+static uint64_t
+bench_now_us (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* User and system time of the calling thread, in seconds */
+static double
+bench_thread_cpu (void)
+{
+  struct rusage ru;
+  getrusage (RUSAGE_THREAD, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+      + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e-6;
+}
+
+static int
+bench_cmp (const void *a, const void *b)
+{
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+/* Nearest rank percentile of the sorted values */
+static double
+bench_percentile (const double *values, int n, double p)
+{
+  int rank;
+
+  if (n == 0) {
+    return 0;
+  }
+  rank = (int) (p / 100.0 * n + 0.999999);
+  return values[MIN(MAX(rank, 1), n) - 1];
+}
+
+/* Parses a comma separated list, sizes may end in K, M or G */
+static int
+bench_parse_list (const char *str, double *values)
+{
+  char *end;
+  int n = 0;
+
+  while (*str && n < BENCH_MAX_VALUES) {
+    values[n] = strtod (str, &end);
+    if (end == str) {
+      return -1;
+    }
+    switch (*end)
+      {
+      case 'G': case 'g': values[n] *= 1024;
+      /* fall through */
+      case 'M': case 'm': values[n] *= 1024;
+      /* fall through */
+      case 'K': case 'k': values[n] *= 1024; end++;
+      }
+    n++;
+    str = *end == ',' ? end + 1 : end;
+    if (*end != ',' && *end != '\0') {
+      return -1;
+    }
+  }
+  return n;
+}
+
+/* Parses a comma separated list of congestion control names */
+static int
+bench_parse_cc (const char *str, const char **names)
+{
+  char *copy = strdup (str);
+  const microtcp_cc_ops_t *ops;
+  int n = 0;
+
+  for (char *name = strtok (copy, ","); name && n < BENCH_MAX_VALUES; name = strtok (NULL, ",")) {
+    if ((ops = microtcp_cc_find (name)) == NULL) {
+      free (copy);
+      return -1;
     }
+    names[n++] = ops->name;
+  }
+  free (copy);
+  return n;
+}
 
-    printf("SENDING CHUNK %d\n", c++);
+static int
+bench_recv_all (const struct bench_config *config, int sd, microtcp_sock_t *sock, uint8_t *buffer, size_t len)
+{
+  ssize_t received;
 
-    data_sent = microtcp_send (&sock, buffer, read_items * sizeof(uint8_t), 0);
-    if (data_sent != read_items * sizeof(uint8_t)) {
-      printf ("Failed to send the"
-              " amount of data read from the file.\n");
+  while (len > 0) {
+    if (config->tcp) {
+      received = recv (sd, buffer, MIN(len, BENCH_CHUNK), 0);
+    } else {
+      received = microtcp_recv (sock, buffer, MIN(len, BENCH_CHUNK), 0);
+    }
+    if (received <= 0) {
+      return -1;
+    }
+    len -= received;
+  }
+  return 0;
+}
+
+static int
+bench_send_all (const struct bench_config *config, int sd, microtcp_sock_t *sock, const uint8_t *buffer, size_t len)
+{
+  ssize_t sent;
+
+  while (len > 0) {
+    if (config->tcp) {
+      sent = send (sd, buffer, len, MSG_NOSIGNAL);
+    } else {
+      sent = microtcp_send (sock, buffer, len, 0);
+    }
+    if (sent <= 0) {
+      return -1;
+    }
+    buffer += sent;
+    len -= sent;
+  }
+  return 0;
+}
+
+static void
+bench_tcp_timeout (int sd)
+{
+  struct timeval timeout = { BENCH_TIMEOUT_S, 0 };
+
+  setsockopt (sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt (sd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+/* Receives the bulk transfer, echoes the pings and waits for the client
+ * to close. After a failure it closes at once, so the client fails too */
+static void *
+bench_server_thread (void *arg)
+{
+  struct bench_server *server = arg;
+  const struct bench_config *config = server->config;
+  struct sockaddr_in client_addr;
+  socklen_t client_addr_len = sizeof(client_addr);
+  struct timespec start_time;
+  struct timespec end_time;
+  double cpu;
+  int sd = -1;
+  int one = 1;
+
+  if (config->tcp) {
+    sd = accept (server->sd, (struct sockaddr *) &client_addr, &client_addr_len);
+    if (sd == -1) {
+      server->error = 1;
+      return NULL;
+    }
+    setsockopt (sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    bench_tcp_timeout (sd);
+  } else if (microtcp_accept (server->sock, (struct sockaddr *) &client_addr, client_addr_len) == -1) {
+    server->error = 1;
+    return NULL;
+  }
+
+  cpu = bench_thread_cpu ();
+  clock_gettime (CLOCK_MONOTONIC_RAW, &start_time);
+  if (bench_recv_all (config, sd, server->sock, server->buffer, config->size) == -1) {
+    server->error = 1;
+  }
+  clock_gettime (CLOCK_MONOTONIC_RAW, &end_time);
+  server->cpu = bench_thread_cpu () - cpu;
+  server->seconds = end_time.tv_sec - start_time.tv_sec
+      + (end_time.tv_nsec - start_time.tv_nsec) * 1e-9;
+
+  for (int i = 0; i < server->pings && !server->error; i++) {
+    if (bench_recv_all (config, sd, server->sock, server->buffer, BENCH_PING_LEN) == -1
+        || bench_send_all (config, sd, server->sock, server->buffer, BENCH_PING_LEN) == -1) {
+      server->error = 1;
+    }
+  }
+
+  if (config->tcp) {
+    while (!server->error && recv (sd, server->buffer, BENCH_CHUNK, 0) > 0);
+    shutdown (sd, SHUT_RDWR);
+    close (sd);
+  } else {
+    while (!server->error && microtcp_recv (server->sock, server->buffer, BENCH_CHUNK, 0) > 0);
+    microtcp_shutdown (server->sock, SHUT_RDWR);
+    close (server->sock->sd);
+  }
+  return NULL;
+}
+
+static void
+bench_relay_push (struct bench_relay *relay, int dir, const uint8_t *data, size_t len, uint64_t now)
+{
+  struct bench_packet *packet = malloc (sizeof(*packet) + len);
+
+  if (!packet) {
+    return;
+  }
+  packet->next = NULL;
+  packet->release_us = now + relay->delay_us;
+  packet->len = len;
+  memcpy (packet->data, data, len);
+  if (relay->tail[dir]) {
+    relay->tail[dir]->next = packet;
+  } else {
+    relay->head[dir] = packet;
+  }
+  relay->tail[dir] = packet;
+}
+
+static void
+bench_relay_forward (struct bench_relay *relay, int dir, const uint8_t *data, size_t len)
+{
+  if (dir == 0) {
+    send (relay->server_sd, data, len, 0);
+  } else {
+    sendto (relay->client_sd, data, len, 0, (struct sockaddr *) &relay->client_addr, relay->client_addr_len);
+  }
+}
+
+/* Datagrams from the client go to the server (direction 0) and back (1),
+ * each one dropped with the loss rate or held for half of the RTT */
+static void *
+bench_relay_thread (void *arg)
+{
+  struct bench_relay *relay = arg;
+  struct pollfd fds[2] = { { relay->client_sd, POLLIN, 0 }, { relay->server_sd, POLLIN, 0 } };
+  struct bench_packet *packet;
+  struct timespec timeout;
+  uint8_t buffer[65536];
+  uint64_t now;
+  uint64_t wait;
+  ssize_t len;
+
+  while (!relay->stop) {
+    now = bench_now_us ();
+    wait = 10000;
+    for (int dir = 0; dir < 2; dir++) {
+      while ((packet = relay->head[dir]) && packet->release_us <= now) {
+        bench_relay_forward (relay, dir, packet->data, packet->len);
+        relay->head[dir] = packet->next;
+        if (!relay->head[dir]) {
+          relay->tail[dir] = NULL;
+        }
+        free (packet);
+      }
+      if (packet) {
+        wait = MIN(wait, packet->release_us - now);
+      }
+    }
+
+    timeout.tv_sec = 0;
+    timeout.tv_nsec = wait * 1000;
+    if (ppoll (fds, 2, &timeout, NULL) <= 0) {
+      continue;
+    }
+
+    now = bench_now_us ();
+    for (int dir = 0; dir < 2; dir++) {
+      if (!(fds[dir].revents & POLLIN)) {
+        continue;
+      }
+      for (;;) {
+        if (dir == 0) {
+          relay->client_addr_len = sizeof(relay->client_addr);
+          len = recvfrom (relay->client_sd, buffer, sizeof(buffer), MSG_DONTWAIT,
+                          (struct sockaddr *) &relay->client_addr, &relay->client_addr_len);
+        } else {
+          len = recv (relay->server_sd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        }
+        if (len < 0) {
+          break;
+        }
+        if (rand_r (&relay->seed) < relay->loss / 100.0 * RAND_MAX) {
+          continue;
+        }
+        if (relay->delay_us == 0) {
+          bench_relay_forward (relay, dir, buffer, len);
+        } else {
+          bench_relay_push (relay, dir, buffer, len, now);
+        }
+      }
+    }
+  }
+
+  for (int dir = 0; dir < 2; dir++) {
+    while ((packet = relay->head[dir])) {
+      relay->head[dir] = packet->next;
+      free (packet);
+    }
+  }
+  return NULL;
+}
+
+static int
+bench_udp_socket (const struct sockaddr_in *connect_to, struct sockaddr_in *bound)
+{
+  socklen_t len = sizeof(*bound);
+  int bufsize = 8 * 1024 * 1024;
+  int sd = socket (AF_INET, SOCK_DGRAM, 0);
+
+  memset (bound, 0, sizeof(*bound));
+  bound->sin_family = AF_INET;
+  bound->sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  if (sd == -1 || bind (sd, (struct sockaddr *) bound, len) == -1
+      || (connect_to && connect (sd, (const struct sockaddr *) connect_to, sizeof(*connect_to)) == -1)
+      || getsockname (sd, (struct sockaddr *) bound, &len) == -1) {
+    if (sd != -1) {
+      close (sd);
+    }
+    return -1;
+  }
+  setsockopt (sd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+  setsockopt (sd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+  return sd;
+}
+
+/* One repetition of a configuration, adds its figures to the result.
+ * Returns -1 if it failed, its figures are then left out. Every socket of
+ * the run has a timeout, so neither side waits for ever on the other */
+static int
+bench_run (const struct bench_config *config, struct bench_result *result, int rep, int pings,
+           const uint8_t *data, uint8_t *buffer)
+{
+  struct bench_server server;
+  struct bench_relay relay;
+  struct sockaddr_in server_addr;
+  struct sockaddr_in client_addr;
+  socklen_t addr_len = sizeof(server_addr);
+  microtcp_sock_t server_sock;
+  microtcp_sock_t sock;
+  pthread_t server_thread;
+  pthread_t relay_thread;
+  struct tcp_info info;
+  socklen_t info_len = sizeof(info);
+  uint8_t ping[BENCH_PING_LEN] = { 0 };
+  uint64_t start;
+  uint64_t retransmissions = 0;
+  double cpu = 0;
+  int pings_before = result->pings;
+  int connected;
+  int use_relay = !config->tcp && (config->loss > 0 || config->rtt_ms > 0);
+  int window = config->window;
+  int one = 1;
+  int sd = -1;
+  int error = 0;
+
+  memset (&server, 0, sizeof(server));
+  server.config = config;
+  server.buffer = buffer;
+  server.pings = pings;
+  server.sd = -1;
+
+  /* The server listens at a port of the kernel's choice */
+  memset (&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  if (config->tcp) {
+    server.sd = socket (AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    bench_tcp_timeout (server.sd);
+    if (window) {
+      setsockopt (server.sd, SOL_SOCKET, SO_RCVBUF, &window, sizeof(window));
+    }
+    if (bind (server.sd, (struct sockaddr *) &server_addr, addr_len) == -1 || listen (server.sd, 1) == -1
+        || getsockname (server.sd, (struct sockaddr *) &server_addr, &addr_len) == -1) {
+      perror ("Benchmark TCP server");
+      exit (EXIT_FAILURE);
+    }
+  } else {
+    server_sock = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+    microtcp_set_timeout (&server_sock, BENCH_TIMEOUT_S * 1000000ULL);
+    microtcp_set_congestion_control (&server_sock, config->cc);
+    microtcp_set_pacing (&server_sock, config->pacing);
+    if (window) {
+      microtcp_set_recvbuf (&server_sock, window, 0);
+    }
+    if (microtcp_bind (&server_sock, (struct sockaddr *) &server_addr, addr_len) == -1
+        || getsockname (server_sock.sd, (struct sockaddr *) &server_addr, &addr_len) == -1) {
+      perror ("Benchmark microTCP server");
+      exit (EXIT_FAILURE);
+    }
+    server.sock = &server_sock;
+  }
+  pthread_create (&server_thread, NULL, bench_server_thread, &server);
+
+  /* The client connects to the relay, which forwards to the server */
+  if (use_relay) {
+    memset (&relay, 0, sizeof(relay));
+    relay.loss = config->loss;
+    relay.delay_us = config->rtt_ms * 500;
+    relay.seed = rep + 1;
+    relay.server_sd = bench_udp_socket (&server_addr, &client_addr);
+    relay.client_sd = bench_udp_socket (NULL, &client_addr);
+    if (relay.server_sd == -1 || relay.client_sd == -1) {
+      perror ("Benchmark relay");
+      exit (EXIT_FAILURE);
+    }
+    pthread_create (&relay_thread, NULL, bench_relay_thread, &relay);
+  } else {
+    client_addr = server_addr;
+  }
+
+  if (config->tcp) {
+    sd = socket (AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (window) {
+      setsockopt (sd, SOL_SOCKET, SO_SNDBUF, &window, sizeof(window));
+    }
+    setsockopt (sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    bench_tcp_timeout (sd);
+    error = connect (sd, (struct sockaddr *) &client_addr, sizeof(client_addr));
+  } else {
+    sock = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+    microtcp_set_timeout (&sock, BENCH_TIMEOUT_S * 1000000ULL);
+    microtcp_set_congestion_control (&sock, config->cc);
+    microtcp_set_pacing (&sock, config->pacing);
+    if (window) {
+      microtcp_set_recvbuf (&sock, window, 0);
+    }
+    error = microtcp_connect (&sock, (struct sockaddr *) &client_addr, sizeof(client_addr));
+  }
+  connected = !error;
+
+  if (!error) {
+    cpu = bench_thread_cpu ();
+    error = bench_send_all (config, sd, &sock, data, config->size);
+    cpu = bench_thread_cpu () - cpu;
+  }
+
+  for (int i = 0; i < pings && !error; i++) {
+    start = bench_now_us ();
+    error = bench_send_all (config, sd, &sock, ping, BENCH_PING_LEN) == -1
+        || bench_recv_all (config, sd, &sock, ping, BENCH_PING_LEN) == -1;
+    if (!error) {
+      result->pingpong_us[result->pings++] = bench_now_us () - start;
+    }
+  }
+
+  /* Closing after a failure too, so the server fails without waiting for its timeout */
+  if (config->tcp) {
+    if (getsockopt (sd, IPPROTO_TCP, TCP_INFO, &info, &info_len) == 0) {
+      retransmissions = info.tcpi_total_retrans;
+    }
+    shutdown (sd, SHUT_RDWR);
+    close (sd);
+  } else {
+    retransmissions = sock.packets_lost;
+    if (connected) {
       microtcp_shutdown (&sock, SHUT_RDWR);
-      close (sock.sd);
-      free (buffer);
-      fclose (fp);
-      return -EXIT_FAILURE;
     }
+    close (sock.sd);
+  }
 
+  pthread_join (server_thread, NULL);
+  if (config->tcp) {
+    close (server.sd);
+  }
+  if (use_relay) {
+    relay.stop = 1;
+    pthread_join (relay_thread, NULL);
+    close (relay.client_sd);
+    close (relay.server_sd);
   }
 
-  printf ("Data sent. Terminating...\n");
+  if (error || server.error) {
+    printf ("Benchmark %s failed, repetition %d is left out\n", error ? "client" : "server", rep + 1);
+    result->pings = pings_before;
+    result->failed++;
+    return -1;
+  }
+  result->throughput[result->reps++] = config->size / (1024.0 * 1024.0) / server.seconds;
+  result->client_cpu += 100.0 * cpu / server.seconds;
+  result->server_cpu += 100.0 * server.cpu / server.seconds;
+  result->retransmissions += retransmissions;
+  result->max_retransmissions = MAX(result->max_retransmissions, retransmissions);
+  return 0;
+}
 
-  microtcp_shutdown (&sock, SHUT_RDWR);
-  close (sock.sd);
+static const char *
+bench_impl (const struct bench_result *result)
+{
+  return result->config.tcp ? "tcp" : "microtcp";
+}
+
+static const char *
+bench_cc (const struct bench_result *result)
+{
+  return result->config.tcp ? "kernel" : result->config.cc;
+}
+
+static void
+bench_print_json (FILE *fp, const struct bench_result *results, int n)
+{
+  const struct bench_result *r;
+
+  fprintf (fp, "{\n  \"mss\": %d,\n  \"results\": [\n", MICROTCP_MSS);
+  for (int i = 0; i < n; i++) {
+    r = &results[i];
+    fprintf (fp, "    {\"impl\": \"%s\", \"size\": %zu, \"window\": %zu, \"loss_pct\": %g, \"rtt_ms\": %g, "
+             "\"cc\": \"%s\", \"pacing\": %s, \"reps\": %d, \"failed_reps\": %d,\n", bench_impl (r),
+             r->config.size, r->config.window, r->config.loss, r->config.rtt_ms, bench_cc (r),
+             r->config.pacing ? "true" : "false", r->reps, r->failed);
+    fprintf (fp, "     \"throughput_MBps\": {\"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, "
+             "\"max\": %.3f, \"runs\": [", bench_percentile (r->throughput, r->reps, 0),
+             bench_percentile (r->throughput, r->reps, 50), bench_percentile (r->throughput, r->reps, 90),
+             bench_percentile (r->throughput, r->reps, 99), bench_percentile (r->throughput, r->reps, 100));
+    for (int j = 0; j < r->reps; j++) {
+      fprintf (fp, "%s%.3f", j ? ", " : "", r->throughput[j]);
+    }
+    fprintf (fp, "]},\n     \"pingpong_us\": {\"p50\": %.0f, \"p90\": %.0f, \"p99\": %.0f, \"max\": %.0f},\n",
+             bench_percentile (r->pingpong_us, r->pings, 50), bench_percentile (r->pingpong_us, r->pings, 90),
+             bench_percentile (r->pingpong_us, r->pings, 99), bench_percentile (r->pingpong_us, r->pings, 100));
+    fprintf (fp, "     \"cpu_client_pct\": %.1f, \"cpu_server_pct\": %.1f, "
+             "\"retransmissions\": {\"mean\": %.1f, \"max\": %llu}}%s\n", r->client_cpu, r->server_cpu,
+             r->retransmissions, (unsigned long long) r->max_retransmissions, i + 1 < n ? "," : "");
+  }
+  fprintf (fp, "  ]\n}\n");
+}
+
+static void
+bench_print_csv (FILE *fp, const struct bench_result *results, int n)
+{
+  const struct bench_result *r;
+
+  fprintf (fp, "impl,size,window,loss_pct,rtt_ms,cc,pacing,mss,reps,failed_reps,tput_min,tput_p50,tput_p90,tput_p99,tput_max,"
+           "pingpong_p50_us,pingpong_p90_us,pingpong_p99_us,cpu_client_pct,cpu_server_pct,rtx_mean,rtx_max\n");
+  for (int i = 0; i < n; i++) {
+    r = &results[i];
+    fprintf (fp, "%s,%zu,%zu,%g,%g,%s,%d,%d,%d,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.0f,%.0f,%.0f,%.1f,%.1f,%.1f,%llu\n",
+             bench_impl (r), r->config.size, r->config.window, r->config.loss, r->config.rtt_ms, bench_cc (r),
+             r->config.pacing, MICROTCP_MSS, r->reps, r->failed, bench_percentile (r->throughput, r->reps, 0), bench_percentile (r->throughput, r->reps, 50),
+             bench_percentile (r->throughput, r->reps, 90), bench_percentile (r->throughput, r->reps, 99),
+             bench_percentile (r->throughput, r->reps, 100), bench_percentile (r->pingpong_us, r->pings, 50),
+             bench_percentile (r->pingpong_us, r->pings, 90), bench_percentile (r->pingpong_us, r->pings, 99),
+             r->client_cpu, r->server_cpu, r->retransmissions, (unsigned long long) r->max_retransmissions);
+  }
+}
+
+static void
+bench_print_text (const struct bench_result *results, int n)
+{
+  const struct bench_result *r;
+
+  printf ("\n%-9s %10s %9s %6s %7s %-6s %4s | %9s %9s %9s | %8s %8s %8s | %7s %7s | %8s %6s\n", "impl", "size",
+          "window", "loss%", "rtt_ms", "cc", "pace", "MB/s p50", "p10", "p90", "pp_us50", "p90", "p99", "cpu_cli", "cpu_srv", "rtx", "failed");
+  for (int i = 0; i < n; i++) {
+    r = &results[i];
+    printf ("%-9s %10zu %9zu %6g %7g %-6s %4s | %9.2f %9.2f %9.2f | %8.0f %8.0f %8.0f | %6.1f%% %6.1f%% | %8.1f %6d\n",
+            bench_impl (r), r->config.size, r->config.window, r->config.loss, r->config.rtt_ms, bench_cc (r),
+            r->config.pacing ? "on" : "off", bench_percentile (r->throughput, r->reps, 50), bench_percentile (r->throughput, r->reps, 10),
+            bench_percentile (r->throughput, r->reps, 90), bench_percentile (r->pingpong_us, r->pings, 50),
+            bench_percentile (r->pingpong_us, r->pings, 90), bench_percentile (r->pingpong_us, r->pings, 99),
+            r->client_cpu, r->server_cpu, r->retransmissions, r->failed);
+  }
+}
+
+int
+bench (const char *sizes, const char *windows, const char *losses, const char *rtts, const char *ccs,
+       const char *pacings, int reps, int pings, int tcp, const char *json, const char *csv)
+{
+  double size_values[BENCH_MAX_VALUES] = { 1024 * 1024, 16 * 1024 * 1024 };
+  double window_values[BENCH_MAX_VALUES] = { 0 };
+  double loss_values[BENCH_MAX_VALUES] = { 0 };
+  double rtt_values[BENCH_MAX_VALUES] = { 0 };
+  const char *cc_values[BENCH_MAX_VALUES] = { "reno" };
+  double pacing_values[BENCH_MAX_VALUES] = { 0 };
+  int nsizes = 2, nwindows = 1, nlosses = 1, nrtts = 1, nccs = 1, npacings = 1;
+  int combinations;
+  struct bench_result *results;
+  struct bench_result *r;
+  struct bench_config config;
+  size_t max_size = 0;
+  uint8_t *data;
+  uint8_t *buffer;
+  FILE *fp;
+  int failed = 0;
+  int n = 0;
+
+  if ((sizes && (nsizes = bench_parse_list (sizes, size_values)) <= 0)
+      || (windows && (nwindows = bench_parse_list (windows, window_values)) <= 0)
+      || (losses && (nlosses = bench_parse_list (losses, loss_values)) <= 0)
+      || (rtts && (nrtts = bench_parse_list (rtts, rtt_values)) <= 0)
+      || (ccs && (nccs = bench_parse_cc (ccs, cc_values)) <= 0)
+      || (pacings && (npacings = bench_parse_list (pacings, pacing_values)) <= 0) || reps < 1 || pings < 0) {
+    printf ("Invalid benchmark parameters\n");
+    return -EXIT_FAILURE;
+  }
+
+  for (int i = 0; i < nsizes; i++) {
+    max_size = MAX(max_size, (size_t) size_values[i]);
+  }
+  combinations = nsizes * nwindows * nlosses * nrtts * nccs * npacings;
+  results = calloc (2 * combinations, sizeof(*results));
+  data = malloc (max_size);
+  buffer = malloc (BENCH_CHUNK);
+  if (!results || !data || !buffer) {
+    perror ("Allocate benchmark buffers");
+    return -EXIT_FAILURE;
+  }
+  for (size_t i = 0; i < max_size; i++) {
+    data[i] = i * 2654435761u >> 24;
+  }
+
+  /* Every combination, with microTCP and then kernel TCP */
+  for (int impl = 0; impl <= tcp; impl++) {
+    for (int s = 0; s < nsizes; s++) {
+      for (int w = 0; w < nwindows; w++) {
+        for (int l = 0; l < nlosses; l++) {
+          for (int t = 0; t < nrtts; t++) {
+            for (int c = 0; c < nccs; c++) {
+              for (int pc = 0; pc < npacings; pc++) {
+                config.tcp = impl;
+                config.size = size_values[s];
+                config.window = window_values[w];
+                config.loss = loss_values[l];
+                config.rtt_ms = rtt_values[t];
+                config.cc = cc_values[c];
+                config.pacing = pacing_values[pc] != 0;
+                if (config.tcp && (config.loss > 0 || config.rtt_ms > 0 || c > 0 || pc > 0)) {
+                  continue;
+                }
+
+                r = &results[n++];
+                r->config = config;
+                r->throughput = calloc (reps, sizeof(double));
+                r->pingpong_us = calloc (MAX(pings * reps, 1), sizeof(double));
+                for (int rep = 0; rep < reps; rep++) {
+                  fprintf (stderr, "bench: %s size=%zu window=%zu loss=%g%% rtt=%gms cc=%s pacing=%d rep %d/%d\n",
+                           bench_impl (r), config.size, config.window, config.loss, config.rtt_ms, bench_cc (r),
+                           config.pacing, rep + 1, reps);
+                  bench_run (&config, r, rep, pings, data, buffer);
+                }
+                /* The means are over the repetitions that completed */
+                if (r->reps > 0) {
+                  r->client_cpu /= r->reps;
+                  r->server_cpu /= r->reps;
+                  r->retransmissions /= r->reps;
+                }
+                failed += r->failed;
+                qsort (r->throughput, r->reps, sizeof(double), bench_cmp);
+                qsort (r->pingpong_us, r->pings, sizeof(double), bench_cmp);
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
+  bench_print_text (results, n);
+  if (json && (fp = fopen (json, "w"))) {
+    bench_print_json (fp, results, n);
+    fclose (fp);
+  }
+  if (csv && (fp = fopen (csv, "w"))) {
+    bench_print_csv (fp, results, n);
+    fclose (fp);
+  }
+
+  for (int i = 0; i < n; i++) {
+    free (results[i].throughput);
+    free (results[i].pingpong_us);
+  }
+  free (results);
+  free (data);
   free (buffer);
-  fclose (fp);
-  return 0;
+  return failed ? -EXIT_FAILURE : 0;
 }
 
 int
@@ -439,9 +1148,20 @@ main (int argc, char **argv)
   char *ipstr = NULL;
   uint8_t is_server = 0;
   uint8_t use_microtcp = 0;
+  uint8_t is_bench = 0;
+  char *sizes = NULL;
+  char *windows = NULL;
+  char *losses = NULL;
+  char *rtts = NULL;
+  char *ccs = NULL;
+  char *pacings = NULL;
+  char *json = NULL;
+  char *csv = NULL;
+  int reps = 5;
+  int pings = 100;
 
   /* A very easy way to parse command line arguments */
-  while ((opt = getopt (argc, argv, "hsmf:p:a:")) != -1) {
+  while ((opt = getopt (argc, argv, "hsmf:p:a:bS:w:l:r:C:P:n:k:j:c:")) != -1) {
     switch (opt)
       {
       /* If -s is set, program runs on server mode */
@@ -464,10 +1184,45 @@ main (int argc, char **argv)
       case 'a':
         ipstr = strdup (optarg);
         break;
+      case 'b':
+        is_bench = 1;
+        break;
+      case 'S':
+        sizes = optarg;
+        break;
+      case 'w':
+        windows = optarg;
+        break;
+      case 'l':
+        losses = optarg;
+        break;
+      case 'r':
+        rtts = optarg;
+        break;
+      case 'C':
+        ccs = optarg;
+        break;
+      case 'P':
+        pacings = optarg;
+        break;
+      case 'n':
+        reps = atoi (optarg);
+        break;
+      case 'k':
+        pings = atoi (optarg);
+        break;
+      case 'j':
+        json = optarg;
+        break;
+      case 'c':
+        csv = optarg;
+        break;
 
       default:
         printf (
-            "Usage: bandwidth_test [-s] [-m] -p port -f file"
+            "Usage: bandwidth_test [-s] [-m] -p port -f file\n"
+            "       bandwidth_test -b [-m] [-S sizes] [-w windows] [-l losses] [-r rtts] [-C ccs] [-P pacings]\n"
+            "                      [-n reps] [-k pings] [-j file] [-c file]\n"
             "Options:\n"
             "   -s                  If set, the program runs as server. Otherwise as client.\n"
             "   -m                  If set, the program uses the microTCP implementation. Otherwise the normal TCP.\n"
@@ -475,6 +1230,19 @@ main (int argc, char **argv)
             "                       If not, is the source file at the client side that will be sent to the server.\n"
             "   -p <int>            The listening port of the server\n"
             "   -a <string>         The IP address of the server. This option is ignored if the tool runs in server mode.\n"
+            "   -b                  Benchmark mode: runs the server and the client over loopback, for every\n"
+            "                       combination of the values below, with microTCP and then kernel TCP.\n"
+            "                       With -m only microTCP runs.\n"
+            "   -S <list>           Transfer sizes in bytes, with K, M or G suffixes (default 1M,16M)\n"
+            "   -w <list>           Receive windows in bytes, 0 to autotune (default 0)\n"
+            "   -l <list>           Emulated loss in percent, each direction (default 0)\n"
+            "   -r <list>           Emulated RTT in ms (default 0). Kernel TCP only runs without loss and RTT.\n"
+            "   -C <list>           Congestion controls of microTCP: reno, cubic or bbr (default reno)\n"
+            "   -P <list>           Pacing of microTCP, 0 for off and 1 for on (default 0)\n"
+            "   -n <int>            Repetitions of every combination (default 5)\n"
+            "   -k <int>            Ping-pongs of a small segment after each transfer, for their round trip (default 100)\n"
+            "   -j <string>         Writes the results as JSON in this file\n"
+            "   -c <string>         Writes the results as CSV in this file\n"
             "   -h                  prints this help\n");
         exit (EXIT_FAILURE);
       }
@@ -487,7 +1255,10 @@ main (int argc, char **argv)
   /*
    * Depending the use arguments execute the appropriate functions
    */
-  if (is_server) {
+  if (is_bench) {
+    exit_code = bench (sizes, windows, losses, rtts, ccs, pacings, reps, pings, !use_microtcp, json, csv);
+  }
+  else if (is_server) {
 
     if (use_microtcp) {
       exit_code = server_microtcp (port, filestr);
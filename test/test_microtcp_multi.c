@@ -0,0 +1,379 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Many clients at once against one sharded server, over loopback. The
+ * server is microtcp_serve() with workers that accept with
+ * microtcp_accept_conn() and serve their connections with microtcp_poll(),
+ * receiving with microtcp_recv() and microtcp_recvmsg() in turn. Every
+ * client sends in a way of its own: plain, zero-copy, scatter-gather,
+ * CUBIC, BBR, paced, io_uring and non-blocking. Each one sends its id
+ * and then data only it would send, the server adds up what every
+ * connection got and the test passes if all of it arrived intact.
+ *
+ * Exits with 0 if every client passed, 1 otherwise.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../lib/microtcp.h"
+
+#define TEST_WORKERS 2
+#define TEST_SIZE (1024 * 1024)
+#define TEST_TIMEOUT_S 30      /* the server gives up on the clients after that long */
+#define TEST_CHUNK 65536
+
+enum test_mode {
+  MODE_SEND,
+  MODE_SEND_ZC,
+  MODE_SENDMSG,
+  MODE_CUBIC,
+  MODE_BBR,
+  MODE_PACING,
+  MODE_IO_URING,
+  MODE_NONBLOCK,
+  MODE_COUNT
+};
+
+static const char *mode_names[MODE_COUNT] = {
+  "send", "send_zc", "sendmsg", "cubic", "bbr", "pacing", "io_uring", "nonblock"
+};
+
+struct test_client {
+  int id;
+  enum test_mode mode;
+  uint8_t *data;
+  int error;
+};
+
+/* What the server got on the connection of each client */
+struct test_result {
+  size_t bytes;
+  uint64_t sum;
+};
+
+/* A connection of a worker, until its client closes it */
+struct test_conn {
+  microtcp_sock_t sock;
+  uint32_t id;
+  size_t id_len;        /* bytes of the id that arrived so far */
+  size_t bytes;
+  uint64_t sum;
+};
+
+static struct sockaddr_in server_addr;
+static struct test_result results[MODE_COUNT];
+static int clients_done;
+static int workers_ready;
+static uint64_t deadline_us;
+
+static uint64_t
+test_now_us (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* The data of client id, no two clients send the same */
+static void
+test_fill (uint8_t *data, size_t len, int id)
+{
+  uint32_t x = 2654435761u * (id + 1);
+
+  for (size_t i = 0; i < len; i++) {
+    x = x * 1103515245 + 12345;
+    data[i] = x >> 24;
+  }
+}
+
+static uint64_t
+test_sum (const uint8_t *data, size_t len)
+{
+  uint64_t sum = 0;
+
+  for (size_t i = 0; i < len; i++) {
+    sum = sum * 31 + data[i];
+  }
+  return sum;
+}
+
+/* Adds what a connection received to its tally, the first 4 bytes are the id of the client */
+static void
+test_account (struct test_conn *conn, const uint8_t *data, size_t len)
+{
+  while (len > 0 && conn->id_len < sizeof(conn->id)) {
+    ((uint8_t *) &conn->id)[conn->id_len++] = *data++;
+    len--;
+  }
+  for (size_t i = 0; i < len; i++) {
+    conn->sum = conn->sum * 31 + data[i];
+  }
+  conn->bytes += len;
+}
+
+/* Receives what is there, with microtcp_recvmsg() on every other connection. Returns 1 once the client closed */
+static int
+test_serve_conn (struct test_conn *conn, int index)
+{
+  uint8_t buffer[TEST_CHUNK];
+  struct iovec iov[2] = { { buffer, 1000 }, { buffer + 1000, sizeof(buffer) - 1000 } };
+  ssize_t received;
+
+  for (;;) {
+    if (index % 2) {
+      received = microtcp_recvmsg (&conn->sock, iov, 2, 0);
+    } else {
+      received = microtcp_recv (&conn->sock, buffer, sizeof(buffer), 0);
+    }
+    if (received > 0) {
+      test_account (conn, buffer, received);
+      continue;
+    }
+    return !(received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK));
+  }
+}
+
+static void
+test_worker (microtcp_sock_t *listener, int worker, void *arg)
+{
+  struct test_conn *conns = calloc (MODE_COUNT, sizeof(*conns));
+  microtcp_loop_t *loop = microtcp_loop_create ();
+  microtcp_event_t events[MODE_COUNT + 1];
+  struct test_conn *conn;
+  int accepted = 0;
+  int n;
+
+  (void) arg;
+  if (conns == NULL || loop == NULL || microtcp_loop_add (loop, listener, MICROTCP_POLLIN, NULL) == -1) {
+    printf ("Worker %d could not start\n", worker);
+    exit (EXIT_FAILURE);
+  }
+  __atomic_add_fetch (&workers_ready, 1, __ATOMIC_SEQ_CST);
+
+  while (__atomic_load_n (&clients_done, __ATOMIC_SEQ_CST) < MODE_COUNT && test_now_us () < deadline_us) {
+    n = microtcp_poll (loop, events, MODE_COUNT + 1, 50);
+    for (int i = 0; i < n; i++) {
+      if (events[i].socket == listener) {
+        while (accepted < MODE_COUNT && microtcp_accept_conn (listener, &conns[accepted].sock, NULL, NULL) == 0) {
+          microtcp_loop_add (loop, &conns[accepted].sock, MICROTCP_POLLIN, &conns[accepted]);
+          accepted++;
+        }
+        continue;
+      }
+
+      conn = events[i].data;
+      if (test_serve_conn (conn, conn - conns)) {
+        microtcp_loop_del (loop, &conn->sock);
+        microtcp_shutdown (&conn->sock, SHUT_RDWR);
+        if (conn->id_len == sizeof(conn->id) && conn->id < MODE_COUNT) {
+          results[conn->id].bytes = conn->bytes;
+          results[conn->id].sum = conn->sum;
+        }
+        __atomic_add_fetch (&clients_done, 1, __ATOMIC_SEQ_CST);
+      }
+    }
+  }
+
+  microtcp_loop_del (loop, listener);
+  microtcp_loop_free (loop);
+  free (conns);
+}
+
+static void *
+test_server_thread (void *arg)
+{
+  (void) arg;
+  if (microtcp_serve ((struct sockaddr *) &server_addr, sizeof(server_addr), TEST_WORKERS, MODE_COUNT,
+                      SOCK_DGRAM | MICROTCP_NONBLOCK | MICROTCP_IO_URING, test_worker, NULL) == -1) {
+    printf ("The server could not start\n");
+    exit (EXIT_FAILURE);
+  }
+  return NULL;
+}
+
+/* Sends the whole buffer from a non-blocking socket, waiting in its own loop while the window is full */
+static int
+test_send_nonblock (microtcp_sock_t *sock, const uint8_t *data, size_t len)
+{
+  microtcp_loop_t *loop = microtcp_loop_create ();
+  microtcp_event_t event;
+  ssize_t sent;
+  int error = 0;
+
+  if (loop == NULL || microtcp_loop_add (loop, sock, MICROTCP_POLLOUT, NULL) == -1) {
+    return -1;
+  }
+  while (len > 0 && !error) {
+    sent = microtcp_send (sock, data, len, 0);
+    if (sent > 0) {
+      data += sent;
+      len -= sent;
+    } else if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      error = 1;
+    } else if (microtcp_poll (loop, &event, 1, TEST_TIMEOUT_S * 1000) <= 0) {
+      error = 1;
+    }
+  }
+  microtcp_loop_del (loop, sock);
+  microtcp_loop_free (loop);
+  return error ? -1 : 0;
+}
+
+static void *
+test_client_thread (void *arg)
+{
+  struct test_client *client = arg;
+  uint32_t id = client->id;
+  int type = SOCK_DGRAM;
+  microtcp_sock_t sock;
+  struct iovec iov[3];
+  ssize_t sent = 0;
+
+  if (client->mode == MODE_IO_URING) {
+    type |= MICROTCP_IO_URING;
+  } else if (client->mode == MODE_NONBLOCK) {
+    type |= MICROTCP_NONBLOCK;
+  }
+  sock = microtcp_socket (AF_INET, type, 0);
+  microtcp_set_timeout (&sock, TEST_TIMEOUT_S * 1000000ULL);
+  if ((client->mode == MODE_CUBIC && microtcp_set_congestion_control (&sock, "cubic") == -1)
+      || (client->mode == MODE_BBR && microtcp_set_congestion_control (&sock, "bbr") == -1)
+      || (client->mode == MODE_PACING && microtcp_set_pacing (&sock, 1) == -1)
+      || microtcp_connect (&sock, (struct sockaddr *) &server_addr, sizeof(server_addr)) == -1) {
+    client->error = 1;
+    close (sock.sd);
+    return NULL;
+  }
+
+  memcpy (client->data, &id, sizeof(id));
+  switch (client->mode) {
+  case MODE_SEND_ZC:
+    sent = microtcp_send_zc (&sock, client->data, TEST_SIZE + sizeof(id), 0);
+    break;
+  case MODE_SENDMSG:
+    /* the id, then the data cut at a place that is not a segment boundary */
+    iov[0].iov_base = client->data;
+    iov[0].iov_len = sizeof(id);
+    iov[1].iov_base = client->data + sizeof(id);
+    iov[1].iov_len = 3000;
+    iov[2].iov_base = client->data + sizeof(id) + 3000;
+    iov[2].iov_len = TEST_SIZE - 3000;
+    sent = microtcp_sendmsg (&sock, iov, 3, 0);
+    break;
+  case MODE_NONBLOCK:
+    sent = test_send_nonblock (&sock, client->data, TEST_SIZE + sizeof(id)) == 0 ? (ssize_t) (TEST_SIZE + sizeof(id)) : -1;
+    break;
+  default:
+    sent = microtcp_send (&sock, client->data, TEST_SIZE + sizeof(id), 0);
+    break;
+  }
+  if (sent != TEST_SIZE + sizeof(id)) {
+    client->error = 1;
+  }
+
+  microtcp_shutdown (&sock, SHUT_RDWR);
+  close (sock.sd);
+  return NULL;
+}
+
+/* A free port of loopback for the server */
+static int
+test_pick_port (void)
+{
+  socklen_t len = sizeof(server_addr);
+  int sd = socket (AF_INET, SOCK_DGRAM, 0);
+
+  memset (&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  if (sd == -1 || bind (sd, (struct sockaddr *) &server_addr, len) == -1
+      || getsockname (sd, (struct sockaddr *) &server_addr, &len) == -1) {
+    perror ("Pick a port");
+    return -1;
+  }
+  close (sd);
+  return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  struct test_client clients[MODE_COUNT];
+  pthread_t client_threads[MODE_COUNT];
+  pthread_t server_thread;
+  uint64_t expected;
+  int failed = 0;
+
+  (void) argc;
+  (void) argv;
+
+  if (test_pick_port () == -1) {
+    return EXIT_FAILURE;
+  }
+  deadline_us = test_now_us () + TEST_TIMEOUT_S * 1000000ULL;
+  pthread_create (&server_thread, NULL, test_server_thread, NULL);
+  while (__atomic_load_n (&workers_ready, __ATOMIC_SEQ_CST) < TEST_WORKERS) {
+    usleep (1000);
+  }
+
+  for (int i = 0; i < MODE_COUNT; i++) {
+    clients[i].id = i;
+    clients[i].mode = i;
+    clients[i].error = 0;
+    clients[i].data = malloc (TEST_SIZE + sizeof(uint32_t));
+    if (clients[i].data == NULL) {
+      perror ("Allocate the data of the clients");
+      return EXIT_FAILURE;
+    }
+    test_fill (clients[i].data + sizeof(uint32_t), TEST_SIZE, i);
+    pthread_create (&client_threads[i], NULL, test_client_thread, &clients[i]);
+  }
+  for (int i = 0; i < MODE_COUNT; i++) {
+    pthread_join (client_threads[i], NULL);
+  }
+  pthread_join (server_thread, NULL);
+
+  for (int i = 0; i < MODE_COUNT; i++) {
+    expected = test_sum (clients[i].data + sizeof(uint32_t), TEST_SIZE);
+    if (clients[i].error || results[i].bytes != TEST_SIZE || results[i].sum != expected) {
+      printf ("FAIL %-9s client %s, server got %zu of %d bytes%s\n", mode_names[i],
+              clients[i].error ? "failed" : "passed", results[i].bytes, TEST_SIZE,
+              results[i].bytes == TEST_SIZE ? ", wrong data" : "");
+      failed = 1;
+    } else {
+      printf ("ok   %-9s %d bytes\n", mode_names[i], TEST_SIZE);
+    }
+    free (clients[i].data);
+  }
+
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}